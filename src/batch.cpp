@@ -0,0 +1,66 @@
+#include <chrono>
+#include <future>
+#include <utility>
+
+#include "batch.h"
+#include "image_io.h"
+
+namespace joytracer {
+    namespace {
+        double milliseconds_since(std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    Camera RenderJob::camera() const {
+        Camera camera{};
+        camera.set_focal_distance(focal_distance);
+        camera.set_plane_size(plane_size[0], plane_size[1] > 0 ?
+            plane_size[1] : plane_size[0] * static_cast<real>(height) / static_cast<real>(width));
+        camera.set_position(position);
+        camera.set_orientation(orientation);
+        camera.set_wavefront(wavefront);
+        return camera;
+    }
+
+    void render_batch(const Scene &scene, const std::vector<RenderJob> &jobs,
+        ThreadPool &pool, const JobCallback &on_done) {
+        // The job being written and how long it took to render.
+        std::future<double> writing;
+        const RenderJob *written = nullptr;
+        double written_render_time = 0;
+
+        auto finish_write = [&]() {
+            if (!writing.valid()) {
+                return;
+            }
+
+            auto write_time = writing.get();
+
+            if (on_done) {
+                on_done(*written, written_render_time, write_time);
+            }
+        };
+
+        for (const auto &job: jobs) {
+            auto start = std::chrono::steady_clock::now();
+            auto camera = job.camera();
+            auto frame = camera.render_scene(scene, job.width, job.height,
+                {0, 0, job.width, job.height}, 0, job.samples, pool);
+            auto render_time = milliseconds_since(start);
+
+            // One write in flight at a time bounds the frames held.
+            finish_write();
+            written = &job;
+            written_render_time = render_time;
+            writing = std::async(std::launch::async, [&job, frame = std::move(frame)]() {
+                auto write_start = std::chrono::steady_clock::now();
+                write_image(job.output, frame, job.width, job.height);
+                return milliseconds_since(write_start);
+            });
+        }
+
+        finish_write();
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <array>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "joymath.h"
+#include "joytracer.h"
+#include "thread_pool.h"
+
+namespace joytracer {
+    /*
+    * One image of a batch: where the camera is, how it projects, and
+    * where the image goes.
+    */
+    struct RenderJob {
+        Vec3 position{0, 0, real(1.77)};
+        // `{pitch, yaw, roll}`, like `Camera::set_orientation`.
+        std::array<double, 3> orientation{0, 1.5707963267948966, 0};
+        real focal_distance = 1;
+        // Width and height of the image plane. A height of 0 follows the
+        // aspect ratio of the image.
+        std::array<real, 2> plane_size{1, 0};
+        int width = 640, height = 480;
+        int samples = 1;
+        // See `Camera::set_wavefront`.
+        bool wavefront = false;
+        std::string output;
+
+        Camera camera() const;
+    };
+
+    // How long a job took to render and to write, in milliseconds.
+    using JobCallback = std::function<void(const RenderJob &job, double render_time, double write_time)>;
+
+    // Renders `jobs` in order, each on the whole of `pool`, and writes each
+    // image on another thread while the next one renders. `on_done` is
+    // called on the calling thread once a job's image is written. Throws
+    // the first error of a render or a write, after the write in flight.
+    void render_batch(const Scene &scene, const std::vector<RenderJob> &jobs,
+        ThreadPool &pool, const JobCallback &on_done = nullptr);
+}
@@ -0,0 +1,116 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "batch.h"
+#include "image_io.h"
+#include "irradiance_cache.h"
+#include "joytracer.h"
+#include "serialization.h"
+
+namespace {
+    void print_usage() {
+        std::cerr <<
+            "Usage: joytracer_batch <scene.xml> <jobs.xml> [options]\n"
+            "Loads the scene once and renders every job of the job file, writing\n"
+            "each image while the next one renders.\n"
+            "  --threads <count>    Render threads, default one per core.\n"
+            "  --irradiance-cache <error>\n"
+            "                       Share one irradiance cache between all jobs.\n"
+            "  --wavefront          Trace breadth first, one bounce at a time.\n"
+            "A job file lists <job> elements:\n"
+            "  <jobs>\n"
+            "      <job output=\"front.png\" width=\"640\" height=\"480\" samples=\"4\">\n"
+            "          <position>0.0, 0.0, 1.77</position>\n"
+            "          <orientation>0.0, 1.5708, 0.0</orientation>\n"
+            "          <focal-distance>1.0</focal-distance>\n"
+            "          <plane-size>1.0, 0.75</plane-size>\n"
+            "      </job>\n"
+            "  </jobs>\n";
+    }
+
+    double milliseconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+int main(int argc, char** argv) {
+    std::size_t threads = joytracer::ThreadPool::default_thread_count();
+    double irradiance_error = 0.0;
+    bool wavefront = false;
+
+    if (argc < 3) {
+        print_usage();
+        return 1;
+    }
+
+    try {
+        for (int i = 3; i < argc; i += 2) {
+            std::string option = argv[i];
+
+            if (option == "--wavefront") {
+                wavefront = true;
+                --i;
+                continue;
+            }
+
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("Missing value for " + option);
+            }
+
+            if (option == "--threads") {
+                threads = std::stoul(argv[i + 1]);
+            } else if (option == "--irradiance-cache") {
+                irradiance_error = std::stod(argv[i + 1]);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << '\n';
+        print_usage();
+        return 1;
+    }
+
+    try {
+        auto jobs = joytracer::load_jobs(argv[2]);
+
+        for (auto &job: jobs) {
+            if (!joytracer::can_write_image(job.output)) {
+                throw std::runtime_error("Unsupported image format: " + job.output);
+            }
+        }
+
+        joytracer::ThreadPool pool(threads);
+        auto start = std::chrono::steady_clock::now();
+        joytracer::Scene scene = joytracer::load_scene(argv[1], &pool);
+        std::cout << "Scene loaded in " << milliseconds_since(start) << " ms.\n";
+
+        if (irradiance_error > 0) {
+            scene.set_irradiance_cache(std::make_shared<joytracer::IrradianceCache>(
+                static_cast<joytracer::real>(irradiance_error)));
+        }
+
+        for (auto &job: jobs) {
+            job.wavefront = job.wavefront || wavefront;
+        }
+
+        start = std::chrono::steady_clock::now();
+        joytracer::render_batch(scene, jobs, pool,
+            [](const joytracer::RenderJob &job, double render_time, double write_time) {
+                std::cout << "Rendered " << job.output << " (" << job.width << "x" << job.height
+                    << ", " << job.samples << " samples) in " << render_time
+                    << " ms, wrote it in " << write_time << " ms.\n";
+            });
+        std::cout << "Rendered " << jobs.size() << " jobs on " << pool.size() << " threads in "
+            << milliseconds_since(start) << " ms.\n";
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,576 @@
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "framebuffer.h"
+#include "irradiance_cache.h"
+#include "joymath.h"
+#include "joytracer.h"
+#include "progressive.h"
+
+/*
+* Micro benchmarks for the intersection kernels and the math operators, and
+* macro benchmarks for whole rays and frames on fixed scenes.
+*
+* Run with `--benchmark_format=json` (or `--benchmark_out=<file>
+* --benchmark_out_format=json`) for machine readable results.
+*
+* Ray tracing benchmarks also report `allocations` per iteration, which
+* must stay at zero: the tracing hot path must not touch the heap, and a
+* benchmark that allocates ends with an error.
+*/
+namespace {
+    std::atomic<std::size_t> allocation_count{0};
+
+    // Every replaced `operator new` below counts into `allocation_count`,
+    // aligned ones included: the hot path has over-aligned types.
+    void *allocate(std::size_t size, std::size_t alignment = 0) {
+        ++allocation_count;
+        size = size == 0 ? 1 : size;
+#ifdef _WIN32
+        void *p = alignment ? _aligned_malloc(size, alignment) : std::malloc(size);
+#else
+        // `aligned_alloc` wants a multiple of the alignment.
+        void *p = alignment ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) :
+            std::malloc(size);
+#endif
+
+        if (!p) {
+            throw std::bad_alloc();
+        }
+
+        return p;
+    }
+
+    // Out of line, so that GCC doesn't see `free` right after an inlined
+    // `operator new` and warn about a mismatched pair.
+    [[gnu::noinline]] void release(void *p, bool aligned) noexcept {
+#ifdef _WIN32
+        aligned ? _aligned_free(p) : std::free(p);
+#else
+        (void)aligned;
+        std::free(p);
+#endif
+    }
+}
+
+void *operator new(std::size_t size) {
+    return allocate(size);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept {
+    release(p, false);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    release(p, false);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    release(p, true);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+    release(p, true);
+}
+
+namespace {
+    using namespace joytracer;
+
+    const double pi = std::acos(-1);
+
+    // Reports the heap allocations made since `start` as a per iteration
+    // counter, and fails the benchmark if there were any. Call it right
+    // after the timed loop, before anything else touches the state.
+    void report_allocations(benchmark::State &state, std::size_t start) {
+        auto allocations = allocation_count - start;
+        state.counters["allocations"] = benchmark::Counter(
+            static_cast<double>(allocations),
+            benchmark::Counter::kAvgIterations);
+
+        if (allocations > 0) {
+            state.SkipWithError("The tracing hot path allocated");
+        }
+    }
+
+    // A 16 columns wide fan of rays from the default camera position, so
+    // kernels see a mix of hits and misses rather than one constant input.
+    // Neighbouring rays are close, like the rays of neighbouring pixels.
+    std::vector<Ray> ray_fan(std::size_t count) {
+        std::vector<Ray> rays;
+        rays.reserve(count);
+
+        for (std::size_t i = 0; i < count; ++i) {
+            double yaw = pi * (0.25 + 0.5 * (i % 16) / 16);
+            double pitch = 0.5 * (static_cast<double>(i / 16) / (count / 16) - 0.5);
+            rays.emplace_back(
+                Vec3{0.0, 0.0, 1.77},
+                Normal3(vec3_cast<real>(std::array<double, 3>{std::cos(yaw), std::sin(yaw), pitch})));
+        }
+
+        return rays;
+    }
+
+    // The contents of scenes/test_scene.xml.
+    Scene test_scene() {
+        const auto sand = Color::from_rgb({0.8, 0.8, 0.4});
+        std::vector<Surface> surfaces {
+            Floor(),
+            Triangle({Vec3{-1.0, 14.0, 0.0}, Vec3{7.0, 14.0, 0.0}, Vec3{3.0, 18.0, 5.0}}, sand),
+            Triangle({Vec3{-1.0, 22.0, 0.0}, Vec3{-1.0, 14.0, 0.0}, Vec3{3.0, 18.0, 5.0}}, sand),
+            Triangle({Vec3{7.0, 22.0, 0.0}, Vec3{-1.0, 22.0, 0.0}, Vec3{3.0, 18.0, 5.0}}, sand),
+            Triangle({Vec3{7.0, 14.0, 0.0}, Vec3{7.0, 22.0, 0.0}, Vec3{3.0, 18.0, 5.0}}, sand),
+            Sphere(0.5, Vec3{1.0, 3.0, 0.5}, Color::from_rgb({0.0, 0.1, 1.0})),
+            Sphere(0.5, Vec3{-1.0, 3.5, 0.5}, Color::from_rgb({0.0, 0.8, 0.1})),
+            Sphere(1.0, Vec3{0.0, 6.0, 1.0}, Color::white()),
+        };
+        return Scene(std::move(surfaces), Color::from_rgb({0.0, 0.4, 0.8}), Normal3(Vec3{1.0, 1.0, -1.0}));
+    }
+
+    // A floor with a square grid of `side * side` small spheres in front of
+    // the camera.
+    Scene sphere_grid_scene(int side) {
+        std::vector<Surface> surfaces {Floor()};
+
+        for (int i = 0; i < side; ++i) {
+            for (int j = 0; j < side; ++j) {
+                surfaces.push_back(Sphere(
+                    0.4,
+                    vec3_cast<real>(std::array<double, 3>{-0.5 * side + i, 3.0 + j, 0.4 + 0.1 * ((i + j) % 3)}),
+                    Color::from_rgb(vec3_cast<real>(std::array<double, 3>{0.2 + 0.6 * i / side, 0.5, 0.2 + 0.6 * j / side}))));
+            }
+        }
+
+        return Scene(std::move(surfaces), Color::from_rgb({0.0, 0.4, 0.8}), Normal3(Vec3{1.0, 1.0, -1.0}));
+    }
+
+    // A wavy terrain of `2 * side * side` triangles in front of the camera,
+    // as one TriangleMesh or as separate Triangle surfaces.
+    Scene terrain_scene(int side, bool as_mesh) {
+        auto vertices = std::make_shared<std::vector<Vec3>>();
+        std::vector<std::array<uint32_t, 3>> faces;
+        const double cell = 40.0 / side;
+
+        for (int j = 0; j <= side; ++j) {
+            for (int i = 0; i <= side; ++i) {
+                double x = -20.0 + i * cell;
+                double y = 2.0 + j * cell;
+                vertices->push_back(vec3_cast<real>(std::array<double, 3>{x, y, 0.5 + 0.5 * std::sin(x * 0.7) * std::cos(y * 0.5)}));
+            }
+        }
+
+        for (int j = 0; j < side; ++j) {
+            for (int i = 0; i < side; ++i) {
+                auto corner = static_cast<uint32_t>(j * (side + 1) + i);
+                auto above = corner + static_cast<uint32_t>(side + 1);
+                faces.push_back({corner, corner + 1, above + 1});
+                faces.push_back({corner, above + 1, above});
+            }
+        }
+
+        const auto color = Color::from_rgb({0.8, 0.8, 0.4});
+        std::vector<Surface> surfaces {Floor()};
+
+        if (as_mesh) {
+            surfaces.push_back(TriangleMesh(vertices, faces, color));
+        } else {
+            for (const auto &face: faces) {
+                surfaces.push_back(Triangle(
+                    {(*vertices)[face[0]], (*vertices)[face[1]], (*vertices)[face[2]]}, color));
+            }
+        }
+
+        return Scene(std::move(surfaces), Color::from_rgb({0.0, 0.4, 0.8}), Normal3(Vec3{1.0, 1.0, -1.0}));
+    }
+
+    Camera default_camera(int width, int height) {
+        Camera camera{};
+        camera.set_focal_distance(1.0);
+        camera.set_plane_size(1.0, static_cast<double>(height) / static_cast<double>(width));
+        camera.set_position(Vec3{0.0, 0.0, 1.77});
+        camera.set_orientation({0.0, pi * 0.50, 0.0});
+        return camera;
+    }
+
+    template<typename TSurface>
+    void hit_test_benchmark(benchmark::State &state, const TSurface &surface) {
+        auto rays = ray_fan(256);
+        std::size_t i = 0;
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(surface.hit_test(rays[i++ & 255]));
+        }
+
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    void BM_triangle_hit_test(benchmark::State &state) {
+        hit_test_benchmark(state, Triangle(
+            {Vec3{-3.0, 8.0, 0.0}, Vec3{3.0, 8.0, 0.0}, Vec3{0.0, 10.0, 4.0}},
+            Color::white()));
+    }
+    BENCHMARK(BM_triangle_hit_test);
+
+    void BM_sphere_hit_test(benchmark::State &state) {
+        hit_test_benchmark(state, Sphere(1.0, Vec3{0.0, 6.0, 1.0}, Color::white()));
+    }
+    BENCHMARK(BM_sphere_hit_test);
+
+    void BM_floor_hit_test(benchmark::State &state) {
+        hit_test_benchmark(state, Floor());
+    }
+    BENCHMARK(BM_floor_hit_test);
+
+    void BM_triangle_mesh_hit_test(benchmark::State &state) {
+        hit_test_benchmark(state, TriangleMesh(
+            std::make_shared<std::vector<Vec3>>(std::vector<Vec3>{
+                Vec3{-3.0, 8.0, 0.0}, Vec3{3.0, 8.0, 0.0}, Vec3{0.0, 10.0, 4.0}}),
+            {{0, 1, 2}},
+            Color::white()));
+    }
+    BENCHMARK(BM_triangle_mesh_hit_test);
+
+    void BM_project_ray_on_plane_frontface(benchmark::State &state) {
+        auto rays = ray_fan(256);
+        Vec3 origin{0.0, 0.0, 0.0};
+        Normal3 normal(Vec3{0.0, 0.0, 1.0});
+        std::size_t i = 0;
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(project_ray_on_plane_frontface(rays[i++ & 255], origin, normal));
+        }
+
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_project_ray_on_plane_frontface);
+
+    // The Vec3*Mat3x3 product from docs/vectorization.md.
+    void BM_dot(benchmark::State &state) {
+        Vec3 vec{0.3, -0.2, 0.9};
+        auto matrix = normal_to_orthonormal_matrix(
+            Normal3(Vec3{1.0, 2.0, 3.0}), Normal3(Vec3{-2.0, 1.0, 0.0}));
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(vec);
+            benchmark::DoNotOptimize(dot(vec, matrix));
+        }
+    }
+    BENCHMARK(BM_dot);
+
+    void BM_inner_product(benchmark::State &state) {
+        Vec3 a{0.3, -0.2, 0.9};
+        Vec3 b{1.0, 2.0, 3.0};
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(a);
+            benchmark::DoNotOptimize(dot(a, b));
+        }
+    }
+    BENCHMARK(BM_inner_product);
+
+    void BM_cross(benchmark::State &state) {
+        Vec3 a{0.3, -0.2, 0.9};
+        Vec3 b{1.0, 2.0, 3.0};
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(a);
+            benchmark::DoNotOptimize(cross(a, b));
+        }
+    }
+    BENCHMARK(BM_cross);
+
+    void BM_arithmetic(benchmark::State &state) {
+        Vec3 a{0.3, -0.2, 0.9};
+        Vec3 b{1.0, 2.0, 3.0};
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(a);
+            benchmark::DoNotOptimize((a + b) * real(0.5) - a * b / real(3));
+        }
+    }
+    BENCHMARK(BM_arithmetic);
+
+    void BM_normalize(benchmark::State &state) {
+        Vec3 a{0.3, -0.2, 0.9};
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(a);
+            benchmark::DoNotOptimize(Normal3(a));
+        }
+    }
+    BENCHMARK(BM_normalize);
+
+    // Arg: recursion depth.
+    void BM_trace_ray(benchmark::State &state) {
+        auto scene = test_scene();
+        auto rays = ray_fan(256);
+        auto depth = static_cast<int>(state.range(0));
+        std::size_t i = 0;
+
+        std::size_t allocations = allocation_count;
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(scene.trace_ray(rays[i++ & 255], depth));
+        }
+
+        report_allocations(state, allocations);
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_trace_ray)->Arg(1)->Arg(2)->Arg(4);
+
+    // Arg: grid side, the scene holds its square in spheres.
+    void BM_trace_ray_sphere_grid(benchmark::State &state) {
+        auto scene = sphere_grid_scene(static_cast<int>(state.range(0)));
+        auto rays = ray_fan(256);
+        std::size_t i = 0;
+
+        std::size_t allocations = allocation_count;
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(scene.trace_ray(rays[i++ & 255], 2));
+        }
+
+        report_allocations(state, allocations);
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_trace_ray_sphere_grid)->RangeMultiplier(4)->Range(4, 256);
+
+    // Args: terrain side, 1 for a TriangleMesh or 0 for separate triangles.
+    void BM_trace_ray_terrain(benchmark::State &state) {
+        auto scene = terrain_scene(static_cast<int>(state.range(0)), state.range(1) != 0);
+        auto rays = ray_fan(256);
+        std::size_t i = 0;
+
+        std::size_t allocations = allocation_count;
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(scene.trace_ray(rays[i++ & 255], 2));
+        }
+
+        report_allocations(state, allocations);
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_trace_ray_terrain)->ArgsProduct({{16, 256}, {0, 1}});
+
+    // Args: terrain side, 1 for a TriangleMesh or 0 for separate
+    // triangles. Any hit queries, as for shadow rays.
+    void BM_occluded_terrain(benchmark::State &state) {
+        auto scene = terrain_scene(static_cast<int>(state.range(0)), state.range(1) != 0);
+        auto rays = ray_fan(256);
+        std::size_t i = 0;
+
+        std::size_t allocations = allocation_count;
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(scene.occluded(rays[i++ & 255]));
+        }
+
+        report_allocations(state, allocations);
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_occluded_terrain)->ArgsProduct({{16, 256}, {0, 1}});
+
+    // Arg: grid side. Primary and shadow rays only, one at a time.
+    void BM_primary_rays_scalar(benchmark::State &state) {
+        auto scene = sphere_grid_scene(static_cast<int>(state.range(0)));
+        auto rays = ray_fan(256);
+
+        std::size_t allocations = allocation_count;
+
+        for (auto _: state) {
+            for (const auto &ray: rays) {
+                benchmark::DoNotOptimize(scene.trace_ray(ray, 1));
+            }
+        }
+
+        report_allocations(state, allocations);
+        state.SetItemsProcessed(state.iterations() * rays.size());
+    }
+    BENCHMARK(BM_primary_rays_scalar)->Arg(16)->Arg(64);
+
+    // Arg: grid side. The same rays as above, traced in packets.
+    void BM_primary_rays_packet(benchmark::State &state) {
+        auto scene = sphere_grid_scene(static_cast<int>(state.range(0)));
+        auto rays = ray_fan(256);
+        std::vector<RayPacket> packets;
+
+        for (std::size_t first = 0; first < rays.size(); first += packet_width) {
+            Lanes<Vec3> origins, directions;
+            Lanes<bool> active{};
+
+            for (std::size_t i = 0; i < packet_width && first + i < rays.size(); ++i) {
+                origins[i] = rays[first + i].get_origin();
+                directions[i] = rays[first + i].get_normal();
+                active[i] = true;
+            }
+
+            packets.push_back(RayPacket::from_rays(origins, directions, active));
+        }
+
+        std::size_t allocations = allocation_count;
+
+        for (auto _: state) {
+            for (const auto &packet: packets) {
+                benchmark::DoNotOptimize(scene.trace_packet(packet, 1));
+            }
+        }
+
+        report_allocations(state, allocations);
+        state.SetItemsProcessed(state.iterations() * rays.size());
+    }
+    BENCHMARK(BM_primary_rays_packet)->Arg(16)->Arg(64);
+
+    void BM_render_scene(benchmark::State &state) {
+        auto scene = test_scene();
+        auto camera = default_camera(160, 120);
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(camera.render_scene(scene, 160, 120));
+        }
+
+        state.SetItemsProcessed(state.iterations() * 160 * 120);
+    }
+    BENCHMARK(BM_render_scene)->Unit(benchmark::kMillisecond);
+
+    void BM_render_scene_scalar(benchmark::State &state) {
+        auto scene = test_scene();
+        auto camera = default_camera(160, 120);
+        camera.set_ray_packets(false);
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(camera.render_scene(scene, 160, 120));
+        }
+
+        state.SetItemsProcessed(state.iterations() * 160 * 120);
+    }
+    BENCHMARK(BM_render_scene_scalar)->Unit(benchmark::kMillisecond);
+
+    void BM_render_scene_wavefront(benchmark::State &state) {
+        auto scene = test_scene();
+        auto camera = default_camera(160, 120);
+        camera.set_wavefront(true);
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(camera.render_scene(scene, 160, 120));
+        }
+
+        state.SetItemsProcessed(state.iterations() * 160 * 120);
+    }
+    BENCHMARK(BM_render_scene_wavefront)->Unit(benchmark::kMillisecond);
+
+    // The cost of counting rays and intersection tests.
+    void BM_render_scene_stats(benchmark::State &state) {
+        auto scene = test_scene();
+        auto camera = default_camera(160, 120);
+        scene.set_render_stats(std::make_shared<RenderStats>());
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(camera.render_scene(scene, 160, 120));
+        }
+
+        state.SetItemsProcessed(state.iterations() * 160 * 120);
+    }
+    BENCHMARK(BM_render_scene_stats)->Unit(benchmark::kMillisecond);
+
+    // Arg: 0 to start every frame with an empty irradiance cache, 1 to
+    // keep it from one frame to the next.
+    void BM_render_scene_irradiance_cache(benchmark::State &state) {
+        auto scene = test_scene();
+        auto camera = default_camera(160, 120);
+        scene.set_irradiance_cache(std::make_shared<IrradianceCache>());
+
+        for (auto _: state) {
+            if (state.range(0) == 0) {
+                scene.irradiance_cache()->clear();
+            }
+
+            benchmark::DoNotOptimize(camera.render_scene(scene, 160, 120));
+        }
+
+        state.counters["records"] = static_cast<double>(scene.irradiance_cache()->size());
+        state.SetItemsProcessed(state.iterations() * 160 * 120);
+    }
+    BENCHMARK(BM_render_scene_irradiance_cache)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+    // Args: 8 passes, with adaptive sampling off (0) or at a max error
+    // of 0.01 (10).
+    void BM_render_progressive(benchmark::State &state) {
+        auto scene = test_scene();
+        auto camera = default_camera(160, 120);
+        ThreadPool pool(1);
+        ProgressiveRenderer progressive(160, 120, 1);
+        progressive.set_adaptive(state.range(1) / 1000.0);
+        std::size_t samples = 0;
+
+        for (auto _: state) {
+            progressive.reset();
+
+            while (progressive.sample_count() < state.range(0) && !progressive.converged()) {
+                progressive.render_pass(scene, camera, pool);
+            }
+
+            samples += progressive.total_samples();
+        }
+
+        state.counters["samples_per_pixel"] = benchmark::Counter(
+            static_cast<double>(samples) / (160 * 120), benchmark::Counter::kAvgIterations);
+        state.SetItemsProcessed(samples);
+    }
+    BENCHMARK(BM_render_progressive)
+        ->Args({8, 0})->Args({8, 10})
+        ->Unit(benchmark::kMillisecond);
+
+    // Packing a viewer sized frame into 32 bit pixels, as for an SDL
+    // surface with padded rows.
+    void BM_pack_frame(benchmark::State &state) {
+        const int width = 640;
+        const int height = 480;
+        std::vector<Color> frame(width * height);
+
+        for (std::size_t i = 0; i < frame.size(); ++i) {
+            // Some out of range, to exercise the clamping.
+            auto value = static_cast<real>(i % 701) / 600;
+            frame[i] = Color::from_rgb({value, 1 - value, value / 2});
+        }
+
+        const int pitch = width * 4 + 64;
+        std::vector<uint8_t> pixels(pitch * height);
+
+        for (auto _: state) {
+            pack_frame(frame, width, height, {pixels.data(), pitch, 0, 8, 16, 0xff000000});
+            benchmark::DoNotOptimize(pixels.data());
+            benchmark::ClobberMemory();
+        }
+
+        state.SetItemsProcessed(state.iterations() * width * height);
+    }
+    BENCHMARK(BM_pack_frame)->Unit(benchmark::kMicrosecond);
+
+    // Arg: thread count.
+    void BM_render_scene_parallel(benchmark::State &state) {
+        auto scene = test_scene();
+        auto camera = default_camera(160, 120);
+        ThreadPool pool(static_cast<std::size_t>(state.range(0)));
+
+        for (auto _: state) {
+            benchmark::DoNotOptimize(camera.render_scene(scene, 160, 120, pool));
+        }
+
+        state.SetItemsProcessed(state.iterations() * 160 * 120);
+    }
+    BENCHMARK(BM_render_scene_parallel)
+        ->Arg(1)->Arg(2)->Arg(4)->Arg(8)
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+}
+
+BENCHMARK_MAIN();
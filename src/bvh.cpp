@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "bvh.h"
+
+namespace joytracer {
+    namespace {
+        const std::size_t bin_count = 16;
+        const uint32_t max_leaf_size = 8;
+
+        // Relative cost of a node traversal step against a primitive test.
+        const real traversal_cost = 0.5;
+
+        // Past this depth the build splits at the median, which keeps the
+        // tree within the fixed traversal stack even for degenerate input.
+        const std::size_t median_split_depth = Bvh::max_depth - 33;
+
+        struct Bin {
+            BoundingBox bounds;
+            uint32_t count = 0;
+        };
+    }
+
+    Bvh::Bvh(const std::vector<BoundingBox> &primitive_bounds) {
+        if (primitive_bounds.size() >= std::numeric_limits<uint32_t>::max()) {
+            throw std::length_error("Too many primitives for a Bvh");
+        }
+
+        if (primitive_bounds.empty()) {
+            return;
+        }
+
+        std::vector<Vec3> centroids(primitive_bounds.size());
+        std::transform(primitive_bounds.begin(), primitive_bounds.end(), centroids.begin(),
+            [](const auto &bounds) { return bounds.centroid(); });
+
+        m_primitive_order.resize(primitive_bounds.size());
+        std::iota(m_primitive_order.begin(), m_primitive_order.end(), 0);
+        m_nodes.reserve(2 * primitive_bounds.size());
+        build(primitive_bounds, centroids, 0, static_cast<uint32_t>(primitive_bounds.size()), 0);
+    }
+
+    Bvh::Bvh(std::vector<Node> nodes, uint32_t primitive_count) :
+        m_nodes(std::move(nodes)),
+        m_primitive_order(primitive_count) {
+        std::iota(m_primitive_order.begin(), m_primitive_order.end(), 0);
+
+        if (m_nodes.empty()) {
+            if (primitive_count != 0) {
+                throw std::runtime_error("Bvh without nodes over " + std::to_string(primitive_count) + " primitives");
+            }
+
+            return;
+        }
+
+        // The nodes may come from a file, check that they form a tree the
+        // traversal can walk with its fixed stack.
+        std::vector<uint8_t> visited(m_nodes.size(), 0);
+        std::vector<std::pair<uint32_t, std::size_t>> stack{{0, 1}};
+        std::vector<std::pair<uint32_t, uint32_t>> leaves;
+
+        while (!stack.empty()) {
+            auto [index, depth] = stack.back();
+            stack.pop_back();
+            const auto &node = m_nodes[index];
+
+            if (visited[index]++ || depth > max_depth || node.axis > 2) {
+                throw std::runtime_error("Malformed Bvh node " + std::to_string(index));
+            }
+
+            if (node.count > 0) {
+                if (static_cast<uint64_t>(node.offset) + node.count > primitive_count) {
+                    throw std::runtime_error("Bvh leaf " + std::to_string(index) + " out of range");
+                }
+
+                leaves.push_back({node.offset, node.count});
+                continue;
+            }
+
+            if (index + 1 >= m_nodes.size() || node.offset <= index + 1 || node.offset >= m_nodes.size()) {
+                throw std::runtime_error("Bvh node " + std::to_string(index) + " has no children");
+            }
+
+            stack.push_back({node.offset, depth + 1});
+            stack.push_back({index + 1, depth + 1});
+        }
+
+        // Each primitive must sit in exactly one leaf, or some would never
+        // be tested.
+        std::sort(leaves.begin(), leaves.end());
+        uint64_t covered = 0;
+
+        for (auto [offset, count]: leaves) {
+            if (offset != covered) {
+                throw std::runtime_error("Bvh leaves do not cover all primitives once");
+            }
+
+            covered += count;
+        }
+
+        if (covered != primitive_count) {
+            throw std::runtime_error("Bvh leaves do not cover all primitives once");
+        }
+    }
+
+    void Bvh::refit(const std::vector<BoundingBox> &primitive_bounds) {
+        if (primitive_bounds.size() != m_primitive_order.size()) {
+            throw std::invalid_argument("Bvh refit with the wrong number of primitives");
+        }
+
+        // Children always come after their parent.
+        for (auto index = m_nodes.size(); index-- > 0;) {
+            auto &node = m_nodes[index];
+            BoundingBox bounds;
+
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    bounds.extend(primitive_bounds[i]);
+                }
+            } else {
+                bounds.extend(m_nodes[index + 1].bounds);
+                bounds.extend(m_nodes[node.offset].bounds);
+            }
+
+            node.bounds = bounds;
+        }
+    }
+
+    void Bvh::build(
+        const std::vector<BoundingBox> &primitive_bounds,
+        const std::vector<Vec3> &centroids,
+        uint32_t begin,
+        uint32_t end,
+        std::size_t depth) {
+        auto node_index = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.push_back(Node{BoundingBox(), begin, 0, 0});
+
+        BoundingBox bounds, centroid_bounds;
+        auto first = m_primitive_order.begin() + begin;
+        auto last = m_primitive_order.begin() + end;
+
+        std::for_each(first, last, [&](uint32_t i) {
+            bounds.extend(primitive_bounds[i]);
+            centroid_bounds.extend(centroids[i]);
+        });
+
+        m_nodes[node_index].bounds = bounds;
+        uint32_t count = end - begin;
+
+        if (count <= 2) {
+            m_nodes[node_index].count = static_cast<uint16_t>(count);
+            return;
+        }
+
+        auto extent = centroid_bounds.max() - centroid_bounds.min();
+        auto axis = static_cast<std::size_t>(
+            std::max_element(extent.begin(), extent.end()) - extent.begin());
+        auto middle = first + count / 2;
+
+        if (extent[axis] <= 0.0 || depth >= median_split_depth) {
+            // All centroids overlap, or the tree is too deep for SAH.
+            std::nth_element(first, middle, last, [&](uint32_t a, uint32_t b) {
+                return centroids[a][axis] < centroids[b][axis];
+            });
+        } else {
+            auto bin_of = [&](uint32_t i) -> std::size_t {
+                auto offset = (centroids[i][axis] - centroid_bounds.min()[axis]) / extent[axis];
+                return std::min(bin_count - 1, static_cast<std::size_t>(offset * bin_count));
+            };
+
+            std::array<Bin, bin_count> bins;
+
+            std::for_each(first, last, [&](uint32_t i) {
+                auto &bin = bins[bin_of(i)];
+                bin.bounds.extend(primitive_bounds[i]);
+                ++bin.count;
+            });
+
+            // Sweep from the right to get the cost of each right hand side,
+            // then from the left to find the cheapest split plane.
+            std::array<real, bin_count - 1> right_costs;
+            BoundingBox right_bounds;
+            uint32_t right_count = 0;
+
+            for (std::size_t split = bin_count - 1; split > 0; --split) {
+                right_bounds.extend(bins[split].bounds);
+                right_count += bins[split].count;
+                right_costs[split - 1] = right_bounds.surface_area() * right_count;
+            }
+
+            BoundingBox left_bounds;
+            uint32_t left_count = 0;
+            real best_cost = std::numeric_limits<real>::max();
+            std::size_t best_split = 0;
+
+            for (std::size_t split = 0; split < bin_count - 1; ++split) {
+                left_bounds.extend(bins[split].bounds);
+                left_count += bins[split].count;
+
+                if (left_count == 0 || left_count == count) {
+                    continue;
+                }
+
+                real cost = left_bounds.surface_area() * left_count + right_costs[split];
+
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_split = split;
+                }
+            }
+
+            real leaf_cost = bounds.surface_area() * count;
+            best_cost = traversal_cost * bounds.surface_area() + best_cost;
+
+            if (best_cost >= leaf_cost && count <= max_leaf_size) {
+                m_nodes[node_index].count = static_cast<uint16_t>(count);
+                return;
+            }
+
+            middle = std::partition(first, last, [&](uint32_t i) {
+                return bin_of(i) <= best_split;
+            });
+
+            if (middle == first || middle == last) {
+                middle = first + count / 2;
+                std::nth_element(first, middle, last, [&](uint32_t a, uint32_t b) {
+                    return centroids[a][axis] < centroids[b][axis];
+                });
+            }
+        }
+
+        auto split = static_cast<uint32_t>(middle - m_primitive_order.begin());
+        m_nodes[node_index].axis = static_cast<uint8_t>(axis);
+        build(primitive_bounds, centroids, begin, split, depth + 1);
+        m_nodes[node_index].offset = static_cast<uint32_t>(m_nodes.size());
+        build(primitive_bounds, centroids, split, end, depth + 1);
+    }
+}
@@ -0,0 +1,397 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include "joymath.h"
+#include "ray_packet.h"
+
+namespace joytracer {
+    /*
+    * An axis aligned bounding box.
+    */
+    class BoundingBox {
+    private:
+        Vec3 m_min;
+        Vec3 m_max;
+    public:
+        // An empty box, which any extension replaces.
+        BoundingBox() :
+            m_min{
+                std::numeric_limits<real>::max(),
+                std::numeric_limits<real>::max(),
+                std::numeric_limits<real>::max()},
+            m_max{
+                std::numeric_limits<real>::lowest(),
+                std::numeric_limits<real>::lowest(),
+                std::numeric_limits<real>::lowest()}
+        {}
+
+        BoundingBox(const Vec3 &min, const Vec3 &max) :
+            m_min(min), m_max(max) {}
+
+        const Vec3 &min() const {
+            return m_min;
+        }
+
+        const Vec3 &max() const {
+            return m_max;
+        }
+
+        bool empty() const {
+            return m_min[0] > m_max[0];
+        }
+
+        void extend(const Vec3 &point) {
+            for (std::size_t axis = 0; axis < 3; ++axis) {
+                m_min[axis] = std::min(m_min[axis], point[axis]);
+                m_max[axis] = std::max(m_max[axis], point[axis]);
+            }
+        }
+
+        void extend(const BoundingBox &box) {
+            extend(box.m_min);
+            extend(box.m_max);
+        }
+
+        Vec3 centroid() const {
+            return (m_min + m_max) * real(0.5);
+        }
+
+        real surface_area() const {
+            if (empty()) {
+                return 0;
+            }
+
+            auto size = m_max - m_min;
+            return 2 * (size[0] * size[1] + size[1] * size[2] + size[2] * size[0]);
+        }
+
+        // Slab test. Returns the entry distance if the ray crosses the box
+        // before `max_distance`.
+        std::optional<real> intersect(
+            const Vec3 &origin,
+            const Vec3 &inverse_direction,
+            real max_distance) const {
+            real t_near = 0;
+            real t_far = max_distance;
+
+            for (std::size_t axis = 0; axis < 3; ++axis) {
+                real t0 = (m_min[axis] - origin[axis]) * inverse_direction[axis];
+                real t1 = (m_max[axis] - origin[axis]) * inverse_direction[axis];
+
+                if (t0 > t1) {
+                    std::swap(t0, t1);
+                }
+
+                t_near = std::max(t_near, t0);
+                t_far = std::min(t_far, t1);
+            }
+
+            if (t_near > t_far) {
+                return std::nullopt;
+            }
+
+            return t_near;
+        }
+
+        // Slab test for a whole packet. True if any active lane crosses the
+        // box before its own `max_distance`.
+        bool intersect(const RayPacket &packet, const Lanes<real> &max_distance) const {
+            Lanes<real> t_near, t_far;
+            t_near.fill(0);
+            t_far = max_distance;
+
+            for (std::size_t axis = 0; axis < 3; ++axis) {
+                JOYTRACER_LANE_LOOP
+                for (std::size_t i = 0; i < packet_width; ++i) {
+                    real t0 = (m_min[axis] - packet.origin[axis][i]) * packet.inverse_direction[axis][i];
+                    real t1 = (m_max[axis] - packet.origin[axis][i]) * packet.inverse_direction[axis][i];
+                    t_near[i] = std::max(t_near[i], std::min(t0, t1));
+                    t_far[i] = std::min(t_far[i], std::max(t0, t1));
+                }
+            }
+
+            lane_int any = 0;
+
+            for (std::size_t i = 0; i < packet_width; ++i) {
+                any |= packet.active[i] & static_cast<lane_int>(t_near[i] <= t_far[i]);
+            }
+
+            return any != 0;
+        }
+    };
+
+    /*
+    * Bounding volume hierarchy over a set of bounded primitives, built with
+    * the binned surface area heuristic.
+    *
+    * The tree only knows primitive indices: the owner keeps its primitives
+    * sorted by `primitive_order()` and tests them in the traversal callback.
+    */
+    class Bvh {
+    public:
+        /*
+        * A flattened tree node. The left child of an inner node always
+        * follows its parent, `offset` points to the right child. For leaves
+        * `offset` is the first primitive and `count` is non zero.
+        */
+        struct Node {
+            BoundingBox bounds;
+            uint32_t offset;
+            uint16_t count;
+            uint8_t axis;
+        };
+
+        static constexpr std::size_t max_depth = 96;
+
+        Bvh() = default;
+        explicit Bvh(const std::vector<BoundingBox> &primitive_bounds);
+
+        // A tree built earlier, over primitives already sorted in its
+        // order. Throws `std::runtime_error` if `nodes` is not a tree over
+        // `primitive_count` primitives.
+        Bvh(std::vector<Node> nodes, uint32_t primitive_count);
+
+        const std::vector<uint32_t> &primitive_order() const {
+            return m_primitive_order;
+        }
+
+        const std::vector<Node> &nodes() const {
+            return m_nodes;
+        }
+
+        // Recomputes the node bounds bottom up around new primitive
+        // bounds, given in `primitive_order()`, keeping the tree. Much
+        // cheaper than a rebuild, but traversal slows down as primitives
+        // move away from where the tree was built.
+        void refit(const std::vector<BoundingBox> &primitive_bounds);
+
+        /*
+        * Walks the tree nearest child first, calling `hit_test(index)` on
+        * every primitive whose leaf is reached before `max_distance`.
+        * `hit_test` returns the distance of a hit closer than any previous
+        * one, which then prunes the rest of the walk.
+        */
+        template<typename THitTest>
+        void traverse(
+            const Vec3 &origin,
+            const Vec3 &direction,
+            real max_distance,
+            THitTest &&hit_test) const;
+
+        /*
+        * Packet version of `traverse`: walks every node that any lane of
+        * the packet crosses, calling `hit_test(index)` on each primitive.
+        * `max_distance` is read back after every leaf, so `hit_test` can
+        * shrink it to prune the walk.
+        */
+        template<typename THitTest>
+        void traverse(
+            const RayPacket &packet,
+            const Lanes<real> &max_distance,
+            THitTest &&hit_test) const;
+
+        /*
+        * Any hit walk for occlusion: calls `hit_test(index)`, which returns
+        * a bool, on the primitives whose leaves the ray reaches before
+        * `max_distance`, and stops at the first hit. Children are visited
+        * in ray direction order along their split axis, which is cheaper
+        * than sorting by entry distance and finds blockers about as soon.
+        */
+        template<typename THitTest>
+        bool any_hit(
+            const Vec3 &origin,
+            const Vec3 &direction,
+            real max_distance,
+            THitTest &&hit_test) const;
+
+        static Vec3 inverse_direction(const Vec3 &direction) {
+            Vec3 result;
+            std::transform(direction.begin(), direction.end(), result.begin(),
+                [](real d) -> real {
+                    // -ffast-math assumes finite values, so keep them finite.
+                    const real min_direction = Precision<real>::min_direction;
+                    return 1 / (std::fabs(d) < min_direction ? std::copysign(min_direction, d) : d);
+                });
+            return result;
+        }
+    private:
+        std::vector<Node> m_nodes;
+        std::vector<uint32_t> m_primitive_order;
+
+        void build(
+            const std::vector<BoundingBox> &primitive_bounds,
+            const std::vector<Vec3> &centroids,
+            uint32_t begin,
+            uint32_t end,
+            std::size_t depth);
+    };
+
+    template<typename THitTest>
+    void Bvh::traverse(
+        const Vec3 &origin,
+        const Vec3 &direction,
+        real max_distance,
+        THitTest &&hit_test) const {
+        if (m_nodes.empty()) {
+            return;
+        }
+
+        auto inverse = inverse_direction(direction);
+
+        if (!m_nodes[0].bounds.intersect(origin, inverse, max_distance)) {
+            return;
+        }
+
+        struct Entry {
+            uint32_t node;
+            real distance;
+        };
+
+        std::array<Entry, max_depth + 1> stack;
+        std::size_t stack_size = 0;
+        stack[stack_size++] = {0, 0};
+
+        while (stack_size > 0) {
+            auto entry = stack[--stack_size];
+
+            // The hit may have come closer since this node was pushed.
+            if (entry.distance > max_distance) {
+                continue;
+            }
+
+            const auto &node = m_nodes[entry.node];
+
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    auto distance = hit_test(i);
+
+                    if (distance && *distance < max_distance) {
+                        max_distance = *distance;
+                    }
+                }
+
+                continue;
+            }
+
+            uint32_t near_child = entry.node + 1;
+            uint32_t far_child = node.offset;
+            auto near_distance = m_nodes[near_child].bounds.intersect(origin, inverse, max_distance);
+            auto far_distance = m_nodes[far_child].bounds.intersect(origin, inverse, max_distance);
+
+            if (near_distance && far_distance && *far_distance < *near_distance) {
+                std::swap(near_child, far_child);
+                std::swap(near_distance, far_distance);
+            }
+
+            // Push the far child first, so the near one is popped first.
+            if (far_distance) {
+                stack[stack_size++] = {far_child, *far_distance};
+            }
+
+            if (near_distance) {
+                stack[stack_size++] = {near_child, *near_distance};
+            }
+        }
+    }
+
+    template<typename THitTest>
+    void Bvh::traverse(
+        const RayPacket &packet,
+        const Lanes<real> &max_distance,
+        THitTest &&hit_test) const {
+        if (m_nodes.empty()) {
+            return;
+        }
+
+        // Coherent packets share direction signs, so the first active lane
+        // decides the visiting order for all of them.
+        std::size_t leader = static_cast<std::size_t>(
+            std::find(packet.active.begin(), packet.active.end(), 1) - packet.active.begin());
+
+        if (leader == packet_width) {
+            return;
+        }
+
+        std::array<uint32_t, max_depth + 1> stack;
+        std::size_t stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            const auto node_index = stack[--stack_size];
+            const auto &node = m_nodes[node_index];
+
+            if (!node.bounds.intersect(packet, max_distance)) {
+                continue;
+            }
+
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    hit_test(i);
+                }
+
+                continue;
+            }
+
+            uint32_t near_child = node_index + 1;
+            uint32_t far_child = node.offset;
+
+            if (packet.direction[node.axis][leader] < 0) {
+                std::swap(near_child, far_child);
+            }
+
+            stack[stack_size++] = far_child;
+            stack[stack_size++] = near_child;
+        }
+    }
+
+    template<typename THitTest>
+    bool Bvh::any_hit(
+        const Vec3 &origin,
+        const Vec3 &direction,
+        real max_distance,
+        THitTest &&hit_test) const {
+        if (m_nodes.empty()) {
+            return false;
+        }
+
+        auto inverse = inverse_direction(direction);
+        std::array<uint32_t, max_depth + 1> stack;
+        std::size_t stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            const auto node_index = stack[--stack_size];
+            const auto &node = m_nodes[node_index];
+
+            if (!node.bounds.intersect(origin, inverse, max_distance)) {
+                continue;
+            }
+
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    if (hit_test(i)) {
+                        return true;
+                    }
+                }
+
+                continue;
+            }
+
+            uint32_t near_child = node_index + 1;
+            uint32_t far_child = node.offset;
+
+            if (direction[node.axis] < 0) {
+                std::swap(near_child, far_child);
+            }
+
+            stack[stack_size++] = far_child;
+            stack[stack_size++] = near_child;
+        }
+
+        return false;
+    }
+}
@@ -0,0 +1,45 @@
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "joytracer.h"
+#include "scene_binary.h"
+#include "serialization.h"
+
+namespace {
+    double milliseconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr <<
+            "Usage: joytracer_convert <scene.xml> <scene.joy>\n"
+            "Writes the scene and its BVHs in the binary scene format, which\n"
+            "load_scene maps into memory instead of parsing.\n";
+        return 1;
+    }
+
+    try {
+        joytracer::ThreadPool pool;
+        auto start = std::chrono::steady_clock::now();
+        joytracer::Scene scene = joytracer::load_scene(argv[1], &pool);
+        std::cout << "Loaded " << argv[1] << " in " << milliseconds_since(start) << " ms.\n";
+
+        start = std::chrono::steady_clock::now();
+        joytracer::save_binary_scene(scene, argv[2]);
+        std::cout << "Wrote " << argv[2] << " in " << milliseconds_since(start) << " ms.\n";
+
+        start = std::chrono::steady_clock::now();
+        joytracer::load_binary_scene(argv[2]);
+        std::cout << "It loads in " << milliseconds_since(start) << " ms.\n";
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "file_watcher.h"
+
+namespace joytracer {
+#ifdef __linux__
+    FileWatcher::FileWatcher(const std::string &filename, Callback on_change, int settle_ms) :
+        m_on_change(std::move(on_change)), m_settle_ms(settle_ms) {
+        using namespace std::string_literals;
+
+        auto path = std::filesystem::absolute(filename);
+        m_name = path.filename().string();
+        m_inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+
+        if (m_inotify < 0) {
+            throw std::runtime_error("Could not start inotify: "s + std::strerror(errno));
+        }
+
+        if (inotify_add_watch(m_inotify, path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+            pipe(m_stop_pipe) < 0) {
+            auto error = errno;
+            close(m_inotify);
+            throw std::runtime_error("Could not watch "s + filename + ": " + std::strerror(error));
+        }
+
+        m_thread = std::thread([this]() { loop(); });
+    }
+
+    FileWatcher::~FileWatcher() {
+        char stop = 0;
+        // Only fails on a full pipe, which wakes the thread just the same.
+        [[maybe_unused]] auto written = write(m_stop_pipe[1], &stop, 1);
+        m_thread.join();
+
+        close(m_stop_pipe[0]);
+        close(m_stop_pipe[1]);
+        close(m_inotify);
+    }
+
+    bool FileWatcher::read_events() {
+        alignas(inotify_event) char buffer[4096];
+        bool changed = false;
+        ssize_t size;
+
+        while ((size = read(m_inotify, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t offset = 0; offset < size;) {
+                const auto *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+                changed |= event->len > 0 && m_name == event->name;
+                offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+            }
+        }
+
+        return changed;
+    }
+
+    void FileWatcher::loop() {
+        pollfd fds[2] = {{m_inotify, POLLIN, 0}, {m_stop_pipe[0], POLLIN, 0}};
+        bool changed = false;
+
+        while (true) {
+            // Waits for a first event, then for the burst to end.
+            auto ready = poll(fds, 2, changed ? m_settle_ms : -1);
+
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                return;
+            }
+
+            if (fds[1].revents) {
+                return;
+            }
+
+            if (ready > 0) {
+                changed |= read_events();
+            } else if (changed) {
+                changed = false;
+                m_on_change();
+            }
+        }
+    }
+#else
+    FileWatcher::FileWatcher(const std::string &filename, Callback on_change, int settle_ms) :
+        m_on_change(std::move(on_change)), m_settle_ms(settle_ms) {
+        throw std::runtime_error("Watching " + filename + " needs inotify");
+    }
+
+    FileWatcher::~FileWatcher() = default;
+
+    bool FileWatcher::read_events() {
+        return false;
+    }
+
+    void FileWatcher::loop() {}
+#endif
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace joytracer {
+    /*
+    * Calls `on_change` on a thread of its own after a file is saved.
+    *
+    * Watches the file's directory through inotify, so editors that save
+    * by renaming a new file over the old one are seen as well. The events
+    * of one save come in bursts, which make a single call once they stop
+    * for `settle_ms`. Only available on Linux.
+    */
+    class FileWatcher {
+    public:
+        using Callback = std::function<void()>;
+
+        // Throws `std::runtime_error` if the file can't be watched.
+        FileWatcher(const std::string &filename, Callback on_change, int settle_ms = 20);
+        // Waits for a running `on_change` to return.
+        ~FileWatcher();
+
+        FileWatcher(const FileWatcher&) = delete;
+        FileWatcher& operator=(const FileWatcher&) = delete;
+    private:
+        std::string m_name;
+        Callback m_on_change;
+        int m_settle_ms;
+        int m_inotify = -1;
+        // The destructor writes to the second one to stop the thread.
+        int m_stop_pipe[2] = {-1, -1};
+        std::thread m_thread;
+
+        // Reads the pending events, true if any was about the file.
+        bool read_events();
+        void loop();
+    };
+}
@@ -0,0 +1,32 @@
+#include <cstdint>
+
+#include "framebuffer.h"
+#include "ray_packet.h"
+
+namespace joytracer {
+    void pack_frame(const std::vector<Color> &frame, int width, int height, const PixelTarget &target) {
+        const auto red_shift = static_cast<uint32_t>(target.red_shift);
+        const auto green_shift = static_cast<uint32_t>(target.green_shift);
+        const auto blue_shift = static_cast<uint32_t>(target.blue_shift);
+        const auto alpha = target.alpha_mask;
+
+        auto to_byte = [](real value) {
+            return static_cast<uint32_t>(static_cast<int32_t>(real(255) * std::min(std::max(value, real(0)), real(1))));
+        };
+
+        for (int y = 0; y < height; ++y) {
+            const Color *source = frame.data() + static_cast<std::size_t>(y) * width;
+            auto *row = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(target.pixels) +
+                static_cast<std::ptrdiff_t>(y) * target.pitch);
+
+            JOYTRACER_LANE_LOOP
+            for (int x = 0; x < width; ++x) {
+                const auto &rgb = source[x].to_rgb();
+                row[x] = alpha |
+                    to_byte(rgb[0]) << red_shift |
+                    to_byte(rgb[1]) << green_shift |
+                    to_byte(rgb[2]) << blue_shift;
+            }
+        }
+    }
+}
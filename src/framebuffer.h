@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "joymath.h"
+
+namespace joytracer {
+    /*
+    * Memory of 32 bit pixels to show a frame in, such as a locked SDL
+    * surface. Rows start `pitch` bytes apart, which may be more than the
+    * width in bytes.
+    */
+    struct PixelTarget {
+        void *pixels;
+        int pitch;
+        // Bit offsets of the 8 bit channels in a pixel.
+        int red_shift, green_shift, blue_shift;
+        // Set in every pixel.
+        uint32_t alpha_mask;
+    };
+
+    // Clamps the colors of `frame` to [0, 1], scales them to bytes like
+    // `write_ppm` and writes them straight into `target`, one vectorized
+    // loop per row.
+    void pack_frame(const std::vector<Color> &frame, int width, int height, const PixelTarget &target);
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <array>
@@ -23,10 +24,50 @@ namespace hammersley {
         return {static_cast<double>(i)/static_cast<double>(n), radicalinverse_vdc(i)};
     }
 
-    std::array<double, 3> hemispheresample_uniform(double u, double v) {
+    // The first `N` base 2 radical inverses, the second Hammersley
+    // coordinates of any set up to `N` points.
+    template<std::size_t N>
+    constexpr std::array<double, N> radicalinverse_vdc_table() {
+        std::array<double, N> table{};
+
+        for (std::size_t i = 0; i < N; ++i) {
+            table[i] = radicalinverse_vdc(static_cast<uint32_t>(i));
+        }
+
+        return table;
+    }
+
+    // Radical inverse of `i` in any `base`, for the other Halton dimensions.
+    constexpr double radicalinverse(uint32_t i, uint32_t base) {
+        double inverse_base = 1.0 / base;
+        double factor = inverse_base;
+        double result = 0.0;
+
+        for (; i > 0; i /= base, factor *= inverse_base) {
+            result += (i % base) * factor;
+        }
+
+        return result;
+    }
+
+    // Point `i` of the 2D Halton sequence, which unlike Hammersley does not
+    // need the point count up front. Point 0 is `{0, 0}`.
+    constexpr std::array<double, 2> halton2d(uint32_t i) {
+        return {radicalinverse_vdc(i), radicalinverse(i, 3)};
+    }
+
+    inline std::array<double, 3> hemispheresample_uniform(double u, double v) {
         double phi = v * 2.0 * pi;
         double cosTheta = 1.0 - u;
         double sinTheta = std::sqrt(1.0 - cosTheta * cosTheta);
         return {std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta};
     }
+
+    // Denser toward the pole, in proportion to the cosine of the angle.
+    inline std::array<double, 3> hemispheresample_cos(double u, double v) {
+        double phi = v * 2.0 * pi;
+        double cosTheta = std::sqrt(1.0 - u);
+        double sinTheta = std::sqrt(1.0 - cosTheta * cosTheta);
+        return {std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta};
+    }
 }
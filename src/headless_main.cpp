@@ -0,0 +1,276 @@
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "image_io.h"
+#include "irradiance_cache.h"
+#include "joymath.h"
+#include "joytracer.h"
+#include "partial_image.h"
+#include "progressive.h"
+#include "serialization.h"
+
+namespace {
+    void print_usage() {
+        std::cerr <<
+            "Usage: joytracer_headless <scene.xml> <output.ppm|pfm|png> [options]\n"
+            "  --width <pixels>     Image width, default 640.\n"
+            "  --height <pixels>    Image height, default 480.\n"
+            "  --threads <count>    Render threads, default one per core.\n"
+            "  --samples <count>    Jittered samples averaged per pixel, default 1.\n"
+            "  --max-error <error>  Stop sampling a pixel once the standard error of\n"
+            "                       its color is below this, default 0 (never).\n"
+            "  --sample-map <file>  Also write how many samples each pixel got.\n"
+            "  --irradiance-cache <error>\n"
+            "                       Interpolate diffuse light between shadowed hits\n"
+            "                       whose error is below this, 0.3 is a good start.\n"
+            "  --diffuse-rays <count>\n"
+            "                       Rays traced over the hemisphere of a shadowed hit,\n"
+            "                       default from the scene, or 10.\n"
+            "  --stats <file.json>  Count rays and intersection tests, time each phase,\n"
+            "                       and write the results as JSON, - for stdout.\n"
+            "  --wavefront          Trace breadth first, one bounce at a time.\n"
+            "  --region <x0,y0,x1,y1>\n"
+            "                       Only render the pixels from x0,y0 up to x1,y1.\n"
+            "  --sample-range <first,end>\n"
+            "                       Only render samples first up to end.\n"
+            "Either of the last two writes a partial image instead, for joytracer_merge.\n";
+    }
+
+    // Parses `count` comma separated integers.
+    std::vector<int> parse_ints(const std::string &text, std::size_t count) {
+        std::vector<int> values;
+        std::istringstream in(text);
+        std::string value;
+
+        while (std::getline(in, value, ',')) {
+            values.push_back(std::stoi(value));
+        }
+
+        if (values.size() != count) {
+            throw std::invalid_argument("Expected " + std::to_string(count) + " numbers in " + text);
+        }
+
+        return values;
+    }
+
+    double milliseconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+int main(int argc, char** argv) {
+    int width = 640;
+    int height = 480;
+    std::size_t threads = joytracer::ThreadPool::default_thread_count();
+    int samples = 1;
+    double max_error = 0.0;
+    std::string sample_map_file;
+    double irradiance_error = 0.0;
+    std::size_t diffuse_rays = 0;
+    std::string stats_file;
+    bool wavefront = false;
+    std::vector<int> region;
+    std::vector<int> sample_range;
+
+    if (argc < 3) {
+        print_usage();
+        return 1;
+    }
+
+    std::string scene_file = argv[1];
+    std::string output_file = argv[2];
+
+    try {
+        for (int i = 3; i < argc; i += 2) {
+            std::string option = argv[i];
+
+            if (option == "--wavefront") {
+                wavefront = true;
+                --i;
+                continue;
+            }
+
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("Missing value for " + option);
+            }
+
+            if (option == "--width") {
+                width = std::stoi(argv[i + 1]);
+            } else if (option == "--height") {
+                height = std::stoi(argv[i + 1]);
+            } else if (option == "--threads") {
+                threads = std::stoul(argv[i + 1]);
+            } else if (option == "--samples") {
+                samples = std::stoi(argv[i + 1]);
+            } else if (option == "--max-error") {
+                max_error = std::stod(argv[i + 1]);
+            } else if (option == "--sample-map") {
+                sample_map_file = argv[i + 1];
+            } else if (option == "--stats") {
+                stats_file = argv[i + 1];
+            } else if (option == "--irradiance-cache") {
+                irradiance_error = std::stod(argv[i + 1]);
+            } else if (option == "--diffuse-rays") {
+                diffuse_rays = std::stoul(argv[i + 1]);
+            } else if (option == "--region") {
+                region = parse_ints(argv[i + 1], 4);
+            } else if (option == "--sample-range") {
+                sample_range = parse_ints(argv[i + 1], 2);
+            } else {
+                throw std::invalid_argument("Unknown option " + option);
+            }
+        }
+
+        if (width <= 0 || height <= 0) {
+            throw std::invalid_argument("Image size must be positive");
+        }
+
+        if (samples <= 0) {
+            throw std::invalid_argument("Sample count must be positive");
+        }
+
+        if (!region.empty() || !sample_range.empty()) {
+            if (region.empty()) {
+                region = {0, 0, width, height};
+            }
+
+            if (sample_range.empty()) {
+                sample_range = {0, samples};
+            }
+
+            if (region[0] < 0 || region[1] < 0 || region[2] > width || region[3] > height ||
+                region[0] >= region[2] || region[1] >= region[3]) {
+                throw std::invalid_argument("Region must be a non-empty rectangle within the image");
+            }
+
+            if (sample_range[0] < 0 || sample_range[0] >= sample_range[1]) {
+                throw std::invalid_argument("Sample range must be non-empty and start at 0 or later");
+            }
+
+            if (max_error > 0 || !sample_map_file.empty()) {
+                throw std::invalid_argument("Partial images take a fixed sample count");
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << '\n';
+        print_usage();
+        return 1;
+    }
+
+    try {
+        joytracer::ThreadPool pool(threads);
+        auto start = std::chrono::steady_clock::now();
+        joytracer::Scene scene = joytracer::load_scene(scene_file, &pool);
+        auto load_time = milliseconds_since(start);
+        std::cout << "Scene loaded in " << load_time << " ms.\n";
+
+        if (!stats_file.empty()) {
+            scene.set_render_stats(std::make_shared<joytracer::RenderStats>());
+            scene.render_stats()->add_phase("load", load_time);
+        }
+
+        if (diffuse_rays > 0) {
+            const auto &sampler = scene.sampler();
+            scene.set_sampler(joytracer::HemisphereSampler(diffuse_rays, sampler.mapping(), sampler.rotates()));
+        }
+
+        if (irradiance_error > 0) {
+            scene.set_irradiance_cache(std::make_shared<joytracer::IrradianceCache>(
+                static_cast<joytracer::real>(irradiance_error)));
+        }
+
+        joytracer::Camera camera{};
+        camera.set_focal_distance(1.0);
+        camera.set_plane_size(1.0, static_cast<double>(height) / static_cast<double>(width));
+        camera.set_position(joytracer::Vec3({0.0, 0.0, 1.77}));
+        camera.set_orientation({0.0, std::acos(-1) * 0.50, 0.0});
+        camera.set_wavefront(wavefront);
+
+        if (!region.empty()) {
+            start = std::chrono::steady_clock::now();
+            joytracer::PartialImage part;
+            part.width = width;
+            part.height = height;
+            part.region = {region[0], region[1], region[2], region[3]};
+            part.first_sample = sample_range[0];
+            part.sample_count = sample_range[1] - sample_range[0];
+
+            {
+                joytracer::RenderStats::ScopedPhase phase(scene.render_stats().get(), "trace");
+                part.pixels = camera.render_scene(scene, width, height, part.region,
+                    part.first_sample, part.sample_count, pool);
+            }
+
+            std::cout << "Rendered " << part.region.width() << "x" << part.region.height()
+                << " pixels at " << part.region.x_begin << "," << part.region.y_begin
+                << ", samples " << sample_range[0] << " to " << sample_range[1]
+                << ", on " << pool.size() << " threads in " << milliseconds_since(start) << " ms.\n";
+
+            {
+                joytracer::RenderStats::ScopedPhase phase(scene.render_stats().get(), "write");
+                joytracer::write_partial_image(output_file, part);
+            }
+
+            std::cout << "Wrote " << output_file << ".\n";
+        } else {
+            start = std::chrono::steady_clock::now();
+            joytracer::ProgressiveRenderer progressive(width, height, 1);
+            progressive.set_adaptive(max_error);
+
+            while (progressive.sample_count() < samples && !progressive.converged()) {
+                progressive.render_pass(scene, camera, pool);
+            }
+
+            const auto &frame = progressive.frame();
+            std::cout << "Rendered " << width << "x" << height << " at up to "
+                << progressive.sample_count() << " samples per pixel ("
+                << static_cast<double>(progressive.total_samples()) / (width * height)
+                << " on average) on " << pool.size()
+                << " threads in " << milliseconds_since(start) << " ms.\n";
+
+            if (scene.irradiance_cache()) {
+                std::cout << "Irradiance cache holds " << scene.irradiance_cache()->size() << " records.\n";
+            }
+
+            start = std::chrono::steady_clock::now();
+
+            {
+                joytracer::RenderStats::ScopedPhase phase(scene.render_stats().get(), "write");
+                joytracer::write_image(output_file, frame, width, height);
+            }
+
+            std::cout << "Wrote " << output_file << " in " << milliseconds_since(start) << " ms.\n";
+
+            if (!sample_map_file.empty()) {
+                joytracer::write_image(sample_map_file, progressive.sample_map(), width, height);
+                std::cout << "Wrote " << sample_map_file << ".\n";
+            }
+        }
+
+        if (stats_file == "-") {
+            std::cout << scene.render_stats()->to_json();
+        } else if (!stats_file.empty()) {
+            std::ofstream out(stats_file);
+            out << scene.render_stats()->to_json();
+
+            if (!out) {
+                throw std::runtime_error("Cannot write " + stats_file);
+            }
+
+            std::cout << "Wrote " << stats_file << ".\n";
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
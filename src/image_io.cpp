@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+#ifdef JOYTRACER_HAS_PNG
+#include <png.h>
+#endif
+
+#include "image_io.h"
+
+namespace joytracer {
+    using namespace std::string_literals;
+
+    namespace {
+        bool has_extension(const std::string &filename, const std::string &extension) {
+            return filename.size() >= extension.size() &&
+                filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+        }
+
+        uint8_t to_byte(real value) {
+            return static_cast<uint8_t>(255 * std::clamp(value, real(0), real(1)));
+        }
+
+        std::ofstream open_output(const std::string &filename) {
+            std::ofstream out(filename, std::ios::binary);
+
+            if (!out) {
+                throw std::runtime_error("Cannot open "s + filename + " for writing");
+            }
+
+            return out;
+        }
+    }
+
+    void write_image(const std::string &filename,
+        const std::vector<Color> &frame, int width, int height) {
+        if (has_extension(filename, ".ppm")) {
+            write_ppm(filename, frame, width, height);
+        } else if (has_extension(filename, ".pfm")) {
+            write_pfm(filename, frame, width, height);
+#ifdef JOYTRACER_HAS_PNG
+        } else if (has_extension(filename, ".png")) {
+            write_png(filename, frame, width, height);
+#endif
+        } else {
+            throw std::runtime_error("Unsupported image format: "s + filename);
+        }
+    }
+
+    bool can_write_image(const std::string &filename) {
+#ifdef JOYTRACER_HAS_PNG
+        if (has_extension(filename, ".png")) {
+            return true;
+        }
+#endif
+        return has_extension(filename, ".ppm") || has_extension(filename, ".pfm");
+    }
+
+    void swap_to_little_endian(std::vector<float> &values) {
+        const uint16_t one = 1;
+
+        if (*reinterpret_cast<const uint8_t *>(&one) != 0) {
+            return;
+        }
+
+        for (auto &value: values) {
+            auto *bytes = reinterpret_cast<unsigned char *>(&value);
+            std::reverse(bytes, bytes + sizeof(float));
+        }
+    }
+
+    void write_ppm(const std::string &filename,
+        const std::vector<Color> &frame, int width, int height) {
+        auto out = open_output(filename);
+        out << "P6\n" << width << ' ' << height << "\n255\n";
+        std::vector<uint8_t> row(width * 3);
+
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                auto rgb = frame[y * width + x].to_rgb();
+                std::transform(rgb.begin(), rgb.end(), row.begin() + x * 3, to_byte);
+            }
+
+            out.write(reinterpret_cast<const char*>(row.data()), row.size());
+        }
+    }
+
+    void write_pfm(const std::string &filename,
+        const std::vector<Color> &frame, int width, int height) {
+        auto out = open_output(filename);
+        // A negative scale means little endian samples.
+        out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+        std::vector<float> row(width * 3);
+
+        // PFM stores rows bottom to top.
+        for (int y = height - 1; y >= 0; --y) {
+            for (int x = 0; x < width; ++x) {
+                auto rgb = frame[y * width + x].to_rgb();
+                std::copy(rgb.begin(), rgb.end(), row.begin() + x * 3);
+            }
+
+            swap_to_little_endian(row);
+            out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+        }
+    }
+
+#ifdef JOYTRACER_HAS_PNG
+    void write_png(const std::string &filename,
+        const std::vector<Color> &frame, int width, int height) {
+        std::unique_ptr<FILE, decltype(&fclose)> file(fopen(filename.c_str(), "wb"), &fclose);
+
+        if (!file) {
+            throw std::runtime_error("Cannot open "s + filename + " for writing");
+        }
+
+        png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        png_infop info = png ? png_create_info_struct(png) : nullptr;
+
+        if (!info) {
+            png_destroy_write_struct(&png, nullptr);
+            throw std::runtime_error("png_create_write_struct failed");
+        }
+
+        std::vector<uint8_t> row(width * 3);
+
+        if (setjmp(png_jmpbuf(png))) {
+            png_destroy_write_struct(&png, &info);
+            throw std::runtime_error("Failed writing "s + filename);
+        }
+
+        png_init_io(png, file.get());
+        png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+            PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png, info);
+
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                auto rgb = frame[y * width + x].to_rgb();
+                std::transform(rgb.begin(), rgb.end(), row.begin() + x * 3, to_byte);
+            }
+
+            png_write_row(png, row.data());
+        }
+
+        png_write_end(png, nullptr);
+        png_destroy_write_struct(&png, &info);
+    }
+#endif
+} // namespace joytracer
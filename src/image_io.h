@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "joymath.h"
+
+namespace joytracer {
+    /*
+    * Writes a rendered frame to `filename`. The format follows the
+    * extension: `.ppm` (8 bit, clamped), `.pfm` (32 bit float) or `.png`
+    * when the build found libpng.
+    */
+    void write_image(const std::string &filename,
+        const std::vector<Color> &frame, int width, int height);
+
+    // True if `write_image` supports the extension of `filename`.
+    bool can_write_image(const std::string &filename);
+
+    void write_ppm(const std::string &filename,
+        const std::vector<Color> &frame, int width, int height);
+
+    void write_pfm(const std::string &filename,
+        const std::vector<Color> &frame, int width, int height);
+
+    // Turns little endian floats to host order and back, which only does
+    // anything on big endian hosts.
+    void swap_to_little_endian(std::vector<float> &values);
+
+#ifdef JOYTRACER_HAS_PNG
+    void write_png(const std::string &filename,
+        const std::vector<Color> &frame, int width, int height);
+#endif
+} // namespace joytracer
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+#include "irradiance_cache.h"
+
+namespace joytracer {
+    IrradianceCache::IrradianceCache(real max_error, real min_radius, real max_radius) :
+        m_max_error(max_error),
+        m_min_radius(min_radius),
+        m_max_radius(std::max(min_radius, max_radius)),
+        m_cell_size(max_error * std::max(min_radius, max_radius)),
+        m_size(0) {}
+
+    std::size_t IrradianceCache::CellHash::operator()(const CellKey &key) const {
+        // Large primes, as in Teschner et al. spatial hashing.
+        auto hash = static_cast<uint64_t>(key.cell[0]) * 73856093u ^
+            static_cast<uint64_t>(key.cell[1]) * 19349663u ^
+            static_cast<uint64_t>(key.cell[2]) * 83492791u ^
+            static_cast<uint64_t>(key.depth) * 2654435761u;
+        return static_cast<std::size_t>(hash);
+    }
+
+    IrradianceCache::CellKey IrradianceCache::cell_key(const Vec3 &point, int depth) const {
+        CellKey key{{}, depth};
+        // Floor hits near the horizon lie far enough out to overflow a cell
+        // index. Those far cells merge at the limit, which only costs
+        // lookups there some distance checks; 2^30 is exact in floats and
+        // leaves room for the neighbours of a cell.
+        const real limit = real(1 << 30);
+
+        for (std::size_t axis = 0; axis < 3; ++axis) {
+            auto cell = std::floor(point[axis] / m_cell_size);
+            key.cell[axis] = static_cast<int32_t>(std::clamp(cell, -limit, limit));
+        }
+
+        return key;
+    }
+
+    IrradianceCache::Shard &IrradianceCache::shard(const CellKey &key) {
+        return m_shards[CellHash()(key) % shard_count];
+    }
+
+    const IrradianceCache::Shard &IrradianceCache::shard(const CellKey &key) const {
+        return m_shards[CellHash()(key) % shard_count];
+    }
+
+    std::optional<Color> IrradianceCache::lookup(const Vec3 &point, const Vec3 &normal, int depth) const {
+        auto center = cell_key(point, depth);
+        Vec3 light{0, 0, 0};
+        real total_weight = 0;
+
+        for (int32_t dx = -1; dx <= 1; ++dx) {
+            for (int32_t dy = -1; dy <= 1; ++dy) {
+                for (int32_t dz = -1; dz <= 1; ++dz) {
+                    CellKey key{{center.cell[0] + dx, center.cell[1] + dy, center.cell[2] + dz}, depth};
+                    const auto &s = shard(key);
+                    std::shared_lock lock(s.mutex);
+                    auto cell = s.cells.find(key);
+
+                    if (cell == s.cells.end()) {
+                        continue;
+                    }
+
+                    for (const auto &record: cell->second) {
+                        auto error = vector_length(point - record.point) / record.radius +
+                            std::sqrt(std::max(real(0), 1 - dot(normal, record.normal)));
+
+                        if (error >= m_max_error) {
+                            continue;
+                        }
+
+                        auto weight = 1 / std::max(error, Precision<real>::epsilon);
+                        light = light + record.irradiance.to_rgb() * weight;
+                        total_weight += weight;
+                    }
+                }
+            }
+        }
+
+        if (total_weight == 0) {
+            return std::nullopt;
+        }
+
+        return Color::from_rgb(light / total_weight);
+    }
+
+    void IrradianceCache::insert(const Vec3 &point, const Vec3 &normal, int depth,
+        real mean_distance, const Color &irradiance) {
+        auto key = cell_key(point, depth);
+        auto &s = shard(key);
+        std::unique_lock lock(s.mutex);
+        s.cells[key].push_back({point, normal,
+            std::clamp(mean_distance, m_min_radius, m_max_radius), irradiance});
+        ++m_size;
+    }
+
+    void IrradianceCache::clear() {
+        for (auto &s: m_shards) {
+            std::unique_lock lock(s.mutex);
+            s.cells.clear();
+        }
+
+        m_size = 0;
+    }
+} // namespace joytracer
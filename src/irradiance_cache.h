@@ -0,0 +1,94 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "joymath.h"
+
+namespace joytracer {
+    /*
+    * Remembers the diffuse light gathered at shadowed hits, so nearby hits
+    * can interpolate it instead of tracing a hemisphere of rays each.
+    *
+    * Records follow Ward's irradiance caching: each one keeps the harmonic
+    * mean distance to the geometry its rays hit as a radius, and it is only
+    * reused at a point `x` with normal `n` while its error
+    * `|x - x_i| / R_i + sqrt(1 - n . n_i)` stays below `max_error`.
+    * Lookups blend every such record, weighted by the inverse of its error.
+    * Radii are clamped between `min_radius` and `max_radius`, which keeps
+    * records in open space from spreading too far.
+    *
+    * The light a hit gathers depends on how many bounces are left, so every
+    * depth keeps its own records. They live in a world space hash grid,
+    * split into shards with their own lock, so one cache can be shared by
+    * all render threads, and kept for the next frame as long as the scene
+    * does not change.
+    */
+    class IrradianceCache {
+    public:
+        explicit IrradianceCache(real max_error = real(0.3),
+            real min_radius = real(0.05), real max_radius = real(4));
+
+        IrradianceCache(const IrradianceCache&) = delete;
+        IrradianceCache& operator=(const IrradianceCache&) = delete;
+
+        // The light interpolated from the records around `point`, if any
+        // is close enough.
+        std::optional<Color> lookup(const Vec3 &point, const Vec3 &normal, int depth) const;
+
+        // Adds the light gathered at `point` by rays whose hits were
+        // `mean_distance` away on average.
+        void insert(const Vec3 &point, const Vec3 &normal, int depth,
+            real mean_distance, const Color &irradiance);
+
+        // Forgets every record, for example after the scene changed.
+        void clear();
+
+        std::size_t size() const {
+            return m_size;
+        }
+    private:
+        struct Record {
+            Vec3 point;
+            Vec3 normal;
+            real radius;
+            Color irradiance;
+        };
+
+        struct CellKey {
+            std::array<int32_t, 3> cell;
+            int depth;
+
+            bool operator==(const CellKey &other) const {
+                return cell == other.cell && depth == other.depth;
+            }
+        };
+
+        struct CellHash {
+            std::size_t operator()(const CellKey &key) const;
+        };
+
+        struct Shard {
+            mutable std::shared_mutex mutex;
+            std::unordered_map<CellKey, std::vector<Record>, CellHash> cells;
+        };
+
+        static constexpr std::size_t shard_count = 64;
+
+        real m_max_error;
+        real m_min_radius, m_max_radius;
+        // Records reach at most `m_max_error * m_max_radius`, so a lookup
+        // only needs the cells next to its own.
+        real m_cell_size;
+        std::array<Shard, shard_count> m_shards;
+        std::atomic<std::size_t> m_size;
+
+        CellKey cell_key(const Vec3 &point, int depth) const;
+        Shard &shard(const CellKey &key);
+        const Shard &shard(const CellKey &key) const;
+    };
+}
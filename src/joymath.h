@@ -4,9 +4,44 @@
 #include <functional>
 #include <numeric>
 #include <array>
+#include <vector>
 
 namespace joytracer {
-    const double epsilon = 0.000000001;
+#ifdef JOYTRACER_SINGLE_PRECISION
+    /*
+    * Scalar type of the renderer, picked when building. Define
+    * `JOYTRACER_SINGLE_PRECISION` for floats.
+    */
+    using real = float;
+#else
+    using real = double;
+#endif
+
+    /*
+    * Tolerances that depend on the scalar type.
+    */
+    template<class T>
+    struct Precision;
+
+    template<>
+    struct Precision<double> {
+        // Distances and determinants below this count as zero.
+        static constexpr double epsilon = 0.000000001;
+        // Smallest ray direction component, keeping inverses finite.
+        static constexpr double min_direction = 1e-12;
+    };
+
+    template<>
+    struct Precision<float> {
+        // Hit points land a few ulps off the surface, and a float ulp is
+        // around 1e-6 at ten units from the origin. Secondary rays start
+        // from hit points, so anything closer than this is the surface
+        // they left.
+        static constexpr float epsilon = 0.0001f;
+        static constexpr float min_direction = 1e-12f;
+    };
+
+    const real epsilon = Precision<real>::epsilon;
 
     template<class T, std::size_t N>
     constexpr T dot(const std::array<T, N> &a,
@@ -110,90 +145,154 @@ namespace joytracer {
     /*
     * Non normalized vector.
     */
-    using Vec3 = std::array<double, 3>;
+    template<class T>
+    using BasicVec3 = std::array<T, 3>;
 
     /*
     * 3x3 matrix.
     */
-   using Mat3x3 = std::array<Vec3, 3>;
+    template<class T>
+    using BasicMat3x3 = std::array<BasicVec3<T>, 3>;
 
     /*
     * A normalized vector.
     */
-    class Normal3: public Vec3 {
+    template<class T>
+    class BasicNormal3: public BasicVec3<T> {
     public:
-        constexpr explicit Normal3(const Normal3 &vector):
-            Vec3(vector)
+        constexpr explicit BasicNormal3(const BasicNormal3 &vector):
+            BasicVec3<T>(vector)
         {
 
         }
 
-        constexpr explicit Normal3(const Vec3 &vector):
-            Vec3(normalize(vector))
+        constexpr explicit BasicNormal3(const BasicVec3<T> &vector):
+            BasicVec3<T>(normalize(vector))
         {
 
         }
 
-        constexpr Normal3 to_orthogonal() const {
-            return Normal3 (
-                operator[](1) - operator[](2),
-                -operator[](0) + operator[](2),
-                operator[](0) - operator[](1)
+        constexpr BasicNormal3 to_orthogonal() const {
+            const auto &v = *this;
+            return BasicNormal3 (
+                v[1] - v[2],
+                -v[0] + v[2],
+                v[0] - v[1]
             );
         }
     private:
-        constexpr Normal3(double x, double y, double z): Vec3{x,y,z} { }
+        constexpr BasicNormal3(T x, T y, T z): BasicVec3<T>{x,y,z} { }
     };
 
-    constexpr Normal3 dot(const Normal3 &vec, const Mat3x3 &matrix) {
-        return Normal3(dot((Vec3)vec, matrix));
+    template<class T>
+    constexpr BasicNormal3<T> dot(const BasicNormal3<T> &vec, const BasicMat3x3<T> &matrix) {
+        return BasicNormal3<T>(dot(static_cast<const BasicVec3<T>&>(vec), matrix));
     }
 
-    constexpr Mat3x3 normal_to_orthonormal_matrix(
-        const Normal3 &first_normal,
-        const Normal3 &second_normal) {
-        Normal3 third_normal(cross(first_normal, second_normal));
-        return Mat3x3 {
+    template<class T>
+    constexpr BasicMat3x3<T> normal_to_orthonormal_matrix(
+        const BasicNormal3<T> &first_normal,
+        const BasicNormal3<T> &second_normal) {
+        BasicNormal3<T> third_normal(cross<T>(first_normal, second_normal));
+        return BasicMat3x3<T> {
             first_normal,
-            cross(third_normal, first_normal),
+            cross<T>(third_normal, first_normal),
             third_normal
         };
     }
 
+    /*
+    * Matrix product, so that `dot(dot(vec, a), b) == dot(vec, dot(a, b))`.
+    */
+    template<class T>
+    constexpr BasicMat3x3<T> dot(const BasicMat3x3<T> &a, const BasicMat3x3<T> &b) {
+        return {dot(a[0], b), dot(a[1], b), dot(a[2], b)};
+    }
+
+    template<class T>
+    constexpr BasicMat3x3<T> transpose(const BasicMat3x3<T> &m) {
+        return BasicMat3x3<T> {
+            BasicVec3<T>{m[0][0], m[1][0], m[2][0]},
+            BasicVec3<T>{m[0][1], m[1][1], m[2][1]},
+            BasicVec3<T>{m[0][2], m[1][2], m[2][2]}
+        };
+    }
+
+    template<class T>
+    constexpr T determinant(const BasicMat3x3<T> &m) {
+        return dot(m[0], cross(m[1], m[2]));
+    }
+
+    /*
+    * Inverse of a matrix whose determinant isn't 0, from its cofactors.
+    */
+    template<class T>
+    constexpr BasicMat3x3<T> inverse(const BasicMat3x3<T> &m) {
+        auto scale = 1 / determinant(m);
+        return transpose(BasicMat3x3<T> {
+            cross(m[1], m[2]) * scale,
+            cross(m[2], m[0]) * scale,
+            cross(m[0], m[1]) * scale
+        });
+    }
+
+    /*
+    * Converts a vector to another scalar type.
+    */
+    template<class T, class U>
+    constexpr BasicVec3<T> vec3_cast(const BasicVec3<U> &vector) {
+        return {static_cast<T>(vector[0]), static_cast<T>(vector[1]), static_cast<T>(vector[2])};
+    }
+
     /*
     * Type for a color.
     */
-    class Color {
+    template<class T>
+    class BasicColor {
     private:
-        std::array<double, 3> m_value;
-        constexpr Color(const std::array<double, 3> &rgb) :
+        std::array<T, 3> m_value;
+        constexpr BasicColor(const std::array<T, 3> &rgb) :
             m_value(rgb) {}
     public:
-        constexpr Color(): m_value() {}
-        std::array<double, 3> to_rgb() { return m_value; }
+        constexpr BasicColor(): m_value() {}
+        const std::array<T, 3> &to_rgb() const { return m_value; }
 
-        static constexpr Color from_rgb(const std::array<double, 3> &rgb) {
-            return Color(rgb);
+        static constexpr BasicColor from_rgb(const std::array<T, 3> &rgb) {
+            return BasicColor(rgb);
         }
 
-        static constexpr Color black() { return Color(std::array{0.0, 0.0, 0.0}); }
-        static constexpr Color white() { return Color(std::array{1.0, 1.0, 1.0}); }
+        static constexpr BasicColor black() { return BasicColor(std::array<T, 3>{0, 0, 0}); }
+        static constexpr BasicColor white() { return BasicColor(std::array<T, 3>{1, 1, 1}); }
 
-        static Color blend(
-            const std::vector<Color> &colors
+        static BasicColor blend(
+            const std::vector<BasicColor> &colors
         );
-        static constexpr Color weighted_blend(
-            const Color &first_color, const Color &second_color,
-            const double first_weight, const double second_weight
+        static constexpr BasicColor weighted_blend(
+            const BasicColor &first_color, const BasicColor &second_color,
+            const T first_weight, const T second_weight
         );
-        static constexpr Color substractive_mix(
-            const Color &first_color, const Color &second_color
+        static constexpr BasicColor substractive_mix(
+            const BasicColor &first_color, const BasicColor &second_color
         );
     };
 
-    constexpr Color Color::weighted_blend(
-        const Color &first_color, const Color &second_color,
-        const double first_weight, const double second_weight
+    template<class T>
+    BasicColor<T> BasicColor<T>::blend(
+        const std::vector<BasicColor> &colors
+    ) {
+        return from_rgb(std::accumulate(
+            colors.begin(), colors.end(),
+            std::array<T, 3>{0, 0, 0},
+            [&](const auto &accum, const auto &c) constexpr -> auto {
+                return accum + c.m_value;
+            }
+        ) / static_cast<T>(colors.size()));
+    }
+
+    template<class T>
+    constexpr BasicColor<T> BasicColor<T>::weighted_blend(
+        const BasicColor &first_color, const BasicColor &second_color,
+        const T first_weight, const T second_weight
     ) {
         return from_rgb((
             first_color.m_value * first_weight +
@@ -201,11 +300,95 @@ namespace joytracer {
         ) / (first_weight + second_weight));
     }
 
-    constexpr Color Color::substractive_mix(
-        const Color &first_color, const Color &second_color
+    template<class T>
+    constexpr BasicColor<T> BasicColor<T>::substractive_mix(
+        const BasicColor &first_color, const BasicColor &second_color
     ) {
         return from_rgb(
             first_color.m_value * second_color.m_value
         );
     }
+
+    /*
+    * Sums colors one at a time, to blend them without storing them.
+    */
+    template<class T>
+    class BasicColorAccumulator {
+    private:
+        std::array<T, 3> m_sum;
+        std::size_t m_count;
+    public:
+        constexpr BasicColorAccumulator(): m_sum{0, 0, 0}, m_count(0) {}
+
+        void add(const BasicColor<T> &color) {
+            m_sum = m_sum + color.to_rgb();
+            ++m_count;
+        }
+
+        std::size_t count() const {
+            return m_count;
+        }
+
+        // Same as `Color::blend` of all the added colors.
+        BasicColor<T> average() const {
+            return BasicColor<T>::from_rgb(m_sum / static_cast<T>(m_count));
+        }
+    };
+
+    /*
+    * Like `ColorAccumulator`, but also tracks how much the colors vary, to
+    * tell when a pixel has enough samples.
+    *
+    * Uses Welford's running update of the mean and of the summed squared
+    * deviations from it, which stays accurate in floats over many samples
+    * where the sum of squares minus the squared sum cancels out.
+    */
+    template<class T>
+    class BasicColorStatistics {
+    private:
+        std::size_t m_count;
+        std::array<T, 3> m_mean;
+        std::array<T, 3> m_squared_deviations;
+    public:
+        constexpr BasicColorStatistics(): m_count(0), m_mean{0, 0, 0}, m_squared_deviations{0, 0, 0} {}
+
+        void add(const BasicColor<T> &color) {
+            auto rgb = color.to_rgb();
+            ++m_count;
+            auto delta = rgb - m_mean;
+            m_mean = m_mean + delta / static_cast<T>(m_count);
+            m_squared_deviations = m_squared_deviations + delta * (rgb - m_mean);
+        }
+
+        std::size_t count() const {
+            return m_count;
+        }
+
+        BasicColor<T> average() const {
+            return BasicColor<T>::from_rgb(m_mean);
+        }
+
+        // Unbiased sample variance of the channel that varies most.
+        T variance() const {
+            if (m_count < 2) {
+                return 0;
+            }
+
+            auto spread = m_squared_deviations / static_cast<T>(m_count - 1);
+            return std::max(T(0), *std::max_element(spread.begin(), spread.end()));
+        }
+
+        // Standard error of `average()`, how far it likely is from the
+        // color more samples would converge to.
+        T standard_error() const {
+            return count() == 0 ? T(0) : std::sqrt(variance() / static_cast<T>(count()));
+        }
+    };
+
+    using Vec3 = BasicVec3<real>;
+    using Mat3x3 = BasicMat3x3<real>;
+    using Normal3 = BasicNormal3<real>;
+    using Color = BasicColor<real>;
+    using ColorAccumulator = BasicColorAccumulator<real>;
+    using ColorStatistics = BasicColorStatistics<real>;
 }
@@ -1,23 +1,16 @@
 #include <algorithm>
 #include <iterator>
+#include <limits>
 #include <random>
+#include <stdexcept>
+#include <string>
 
 #include "hammersley.h"
+#include "irradiance_cache.h"
 #include "joytracer.h"
+#include "wavefront.h"
 
 namespace joytracer {
-    Color Color::blend(
-        const std::vector<Color> &colors
-    ) {
-        return from_rgb(std::accumulate(
-            colors.begin(), colors.end(),
-            Vec3{0.0, 0.0, 0.0},
-            [&](const auto &accum, const auto &c) constexpr -> auto {
-                return accum + c.m_value;
-            }
-        ) / static_cast<double>(colors.size()));
-    }
-
     std::optional<HitPoint> project_ray_on_plane_frontface(
         const Ray &ray,
         const Vec3 &plane_origin,
@@ -60,19 +53,68 @@ namespace joytracer {
 
         auto hit_point = projection->point();
 
-        // Check if the point is "behind" all three edges at once. If so
-        // it is between the edges.
-        if (dot(m_normal, cross(m_vertices[1] - m_vertices[0], hit_point - m_vertices[1])) > 0 &&
-            dot(m_normal, cross(m_vertices[2] - m_vertices[1], hit_point - m_vertices[2])) > 0 &&
-            dot(m_normal, cross(m_vertices[0] - m_vertices[2], hit_point - m_vertices[0])) > 0) {
+        if (contains(hit_point)) {
             return HitResult(projection->distance(), hit_point, m_normal, m_color);
         }
 
         return std::nullopt;
     }
 
+    bool Triangle::contains(const Vec3 &point) const {
+        // Check if the point is "behind" all three edges at once. If so
+        // it is between the edges.
+        return dot(m_normal, cross(m_vertices[1] - m_vertices[0], point - m_vertices[1])) > 0 &&
+            dot(m_normal, cross(m_vertices[2] - m_vertices[1], point - m_vertices[2])) > 0 &&
+            dot(m_normal, cross(m_vertices[0] - m_vertices[2], point - m_vertices[0])) > 0;
+    }
+
+    bool Triangle::occluded(const Ray &ray) const {
+        auto projection = project_ray_on_plane_frontface(ray, *m_vertices.begin(), m_normal);
+        return projection && contains(projection->point());
+    }
+
+    void Triangle::hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const {
+        // Same tests as the scalar version, with the edge checks rewritten
+        // as `dot(cross(normal, edge), point - vertex)`.
+        const auto &n = m_normal;
+        const auto &v0 = m_vertices[0];
+        const std::array<Vec3, 3> edge_vertices{m_vertices[1], m_vertices[2], m_vertices[0]};
+        const std::array<Vec3, 3> edge_normals{
+            cross(Vec3(n), m_vertices[1] - m_vertices[0]),
+            cross(Vec3(n), m_vertices[2] - m_vertices[1]),
+            cross(Vec3(n), m_vertices[0] - m_vertices[2])};
+
+        JOYTRACER_LANE_LOOP
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            real ox = packet.origin[0][i], oy = packet.origin[1][i], oz = packet.origin[2][i];
+            real dx = packet.direction[0][i], dy = packet.direction[1][i], dz = packet.direction[2][i];
+            real denom = dx * n[0] + dy * n[1] + dz * n[2];
+            bool facing = denom < -epsilon;
+            real distance = ((v0[0] - ox) * n[0] + (v0[1] - oy) * n[1] + (v0[2] - oz) * n[2]) /
+                (facing ? denom : real(-1));
+            real px = ox + dx * distance, py = oy + dy * distance, pz = oz + dz * distance;
+            auto edge_side = [&](std::size_t e) -> real {
+                return edge_normals[e][0] * (px - edge_vertices[e][0]) +
+                    edge_normals[e][1] * (py - edge_vertices[e][1]) +
+                    edge_normals[e][2] * (pz - edge_vertices[e][2]);
+            };
+            bool inside = std::min(std::min(edge_side(0), edge_side(1)), edge_side(2)) > 0;
+            hits.record(i, (packet.active[i] != 0) & facing & (distance > epsilon) & inside, distance, id);
+        }
+    }
+
+    std::optional<BoundingBox> Triangle::bounds() const {
+        BoundingBox box;
+
+        for (const auto &vertex: m_vertices) {
+            box.extend(vertex);
+        }
+
+        return box;
+    }
+
     std::optional<HitResult> Floor::hit_test(const Ray &ray) const {
-        auto projection = project_ray_on_plane_frontface(ray, Vec3{0.0, 0.0, 0.0}, Normal3(Vec3{0.0, 0.0, 1.0}));
+        auto projection = project_ray_on_plane_frontface(ray, Vec3{0, 0, 0}, Normal3(Vec3{0, 0, 1}));
 
         if (!projection) {
             return std::nullopt;
@@ -82,13 +124,27 @@ namespace joytracer {
         long is_x_odd = static_cast<long>(floorf(hit_point[0])) & 1;
         long is_y_odd = static_cast<long>(floorf(hit_point[1])) & 1;
         return HitResult(projection->distance(), hit_point,
-            Normal3(Vec3{0.0, 0.0, 1.0}),
+            Normal3(Vec3{0, 0, 1}),
             (is_x_odd == is_y_odd) ?
             Color::white() :
             Color::black());
     }
 
-    std::optional<HitResult> Sphere::hit_test(const Ray &ray) const {
+    bool Floor::occluded(const Ray &ray) const {
+        return project_ray_on_plane_frontface(ray, Vec3{0, 0, 0}, Normal3(Vec3{0, 0, 1})).has_value();
+    }
+
+    void Floor::hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const {
+        JOYTRACER_LANE_LOOP
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            real dz = packet.direction[2][i];
+            bool facing = dz < -epsilon;
+            real distance = -packet.origin[2][i] / (facing ? dz : real(-1));
+            hits.record(i, (packet.active[i] != 0) & facing & (distance > epsilon), distance, id);
+        }
+    }
+
+    std::optional<real> Sphere::hit_distance(const Ray &ray) const {
         auto origin_to_center = ray.get_origin() - m_center;
         auto origin_to_center_length = vector_length(origin_to_center);
         auto projection = dot(ray.get_normal(), origin_to_center);
@@ -96,11 +152,11 @@ namespace joytracer {
         origin_to_center_length * origin_to_center_length +
         m_radius * m_radius;
 
-        if (square < 0.0) {
+        if (square < 0) {
             return std::nullopt;
         }
 
-        double distance = square <= epsilon ?
+        real distance = square <= epsilon ?
             -projection :
             -projection - std::sqrt(square);
 
@@ -109,148 +165,989 @@ namespace joytracer {
             return std::nullopt;
         }
 
-        auto hit_point = ray.get_origin() + ray.get_normal() * distance;
+        return distance;
+    }
+
+    std::optional<HitResult> Sphere::hit_test(const Ray &ray) const {
+        auto distance = hit_distance(ray);
+
+        if (!distance) {
+            return std::nullopt;
+        }
+
+        auto hit_point = ray.get_origin() + ray.get_normal() * *distance;
 
         return HitResult(
-            distance,
+            *distance,
             hit_point,
             Normal3(hit_point - m_center),
             m_color);
     }
 
-    std::optional<HitResult> Scene::trace_single_ray(const Ray &ray) const {
-        std::vector<std::optional<HitResult>> hits;
-        hits.reserve(m_surfaces.size());
+    bool Sphere::occluded(const Ray &ray) const {
+        return hit_distance(ray).has_value();
+    }
 
-        for (const auto &s: m_surfaces) {
-            auto h = std::visit(HitTestVisitor(ray), s);
+    void Sphere::hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const {
+        JOYTRACER_LANE_LOOP
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            real ox = packet.origin[0][i] - m_center[0];
+            real oy = packet.origin[1][i] - m_center[1];
+            real oz = packet.origin[2][i] - m_center[2];
+            real projection = packet.direction[0][i] * ox +
+                packet.direction[1][i] * oy +
+                packet.direction[2][i] * oz;
+            real square = projection * projection -
+                (ox * ox + oy * oy + oz * oz) +
+                m_radius * m_radius;
+            real distance = -projection - std::sqrt(std::max(square, real(0)));
+            hits.record(i, (packet.active[i] != 0) & (square >= 0) & (distance > epsilon), distance, id);
+        }
+    }
+
+    std::optional<BoundingBox> Sphere::bounds() const {
+        auto extent = Vec3{m_radius, m_radius, m_radius};
+        return BoundingBox(m_center - extent, m_center + extent);
+    }
+
+    TriangleMesh::TriangleMesh(
+            std::shared_ptr<const std::vector<Vec3>> vertices,
+            std::vector<std::array<uint32_t, 3>> indices,
+            const Color &color
+        ) : m_vertices(std::move(vertices)), m_color(color) {
+        if (indices.empty()) {
+            throw std::invalid_argument("Triangle mesh has no triangles");
+        }
+
+        std::vector<BoundingBox> triangle_bounds;
+        triangle_bounds.reserve(indices.size());
+
+        for (const auto &triangle: indices) {
+            BoundingBox box;
 
-            if (h.has_value()) {
-                hits.push_back(h);
+            for (auto index: triangle) {
+                if (index >= m_vertices->size()) {
+                    throw std::out_of_range("Triangle mesh vertex index out of range");
+                }
+
+                box.extend((*m_vertices)[index]);
+            }
+
+            triangle_bounds.push_back(box);
+        }
+
+        m_bvh = Bvh(triangle_bounds);
+        m_indices.reserve(indices.size());
+
+        for (auto i: m_bvh.primitive_order()) {
+            m_indices.push_back(indices[i]);
+        }
+
+        compute_edges();
+    }
+
+    TriangleMesh::TriangleMesh(
+            std::shared_ptr<const std::vector<Vec3>> vertices,
+            std::vector<std::array<uint32_t, 3>> indices,
+            const Color &color,
+            Bvh bvh
+        ) : m_vertices(std::move(vertices)), m_indices(std::move(indices)),
+        m_bvh(std::move(bvh)), m_color(color) {
+        if (m_indices.empty()) {
+            throw std::invalid_argument("Triangle mesh has no triangles");
+        }
+
+        if (m_indices.size() != m_bvh.primitive_order().size()) {
+            throw std::runtime_error("Triangle mesh Bvh does not match its triangles");
+        }
+
+        for (const auto &triangle: m_indices) {
+            for (auto index: triangle) {
+                if (index >= m_vertices->size()) {
+                    throw std::out_of_range("Triangle mesh vertex index out of range");
+                }
             }
         }
 
-        auto nearest_hit = std::min_element(hits.begin(), hits.end(),
-            [] (auto &a, auto &b) -> bool {
-                return (a->distance() < b->distance());
+        compute_edges();
+    }
+
+    void TriangleMesh::compute_edges() {
+        const auto &v = *m_vertices;
+        m_edges.clear();
+        m_edges.reserve(m_indices.size());
+
+        for (const auto &triangle: m_indices) {
+            m_edges.push_back({
+                v[triangle[1]] - v[triangle[0]],
+                v[triangle[2]] - v[triangle[0]]
+            });
+        }
+    }
+
+    std::optional<real> TriangleMesh::hit_distance(const Ray &ray, uint32_t triangle) const {
+        const auto &[edge1, edge2] = m_edges[triangle];
+        auto p = cross(Vec3(ray.get_normal()), edge2);
+        auto determinant = dot(edge1, p);
+
+        // Parallel to the plane, or hitting the back face.
+        if (determinant < epsilon) {
+            return std::nullopt;
+        }
+
+        auto inverse_determinant = 1 / determinant;
+        auto t = ray.get_origin() - (*m_vertices)[m_indices[triangle][0]];
+        auto u = dot(t, p) * inverse_determinant;
+
+        if (u < 0 || u > 1) {
+            return std::nullopt;
+        }
+
+        auto q = cross(t, edge1);
+        auto v = dot(Vec3(ray.get_normal()), q) * inverse_determinant;
+
+        if (v < 0 || u + v > 1) {
+            return std::nullopt;
+        }
+
+        auto distance = dot(edge2, q) * inverse_determinant;
+
+        // Ignore if behind
+        if (distance <= epsilon) {
+            return std::nullopt;
+        }
+
+        return distance;
+    }
+
+    std::optional<HitResult> TriangleMesh::hit_test(const Ray &ray) const {
+        std::optional<real> nearest_distance;
+        uint32_t nearest_triangle = 0;
+
+        m_bvh.traverse(ray.get_origin(), ray.get_normal(), std::numeric_limits<real>::max(),
+            [&](uint32_t i) -> std::optional<real> {
+                auto distance = hit_distance(ray, i);
+
+                if (!distance || (nearest_distance && *distance >= *nearest_distance)) {
+                    return std::nullopt;
+                }
+
+                nearest_distance = distance;
+                nearest_triangle = i;
+                return distance;
+            });
+
+        if (!nearest_distance) {
+            return std::nullopt;
+        }
+
+        const auto &[edge1, edge2] = m_edges[nearest_triangle];
+        return HitResult(
+            *nearest_distance,
+            ray.get_origin() + ray.get_normal() * *nearest_distance,
+            Normal3(cross(edge1, edge2)),
+            m_color);
+    }
+
+    bool TriangleMesh::occluded(const Ray &ray) const {
+        return m_bvh.any_hit(ray.get_origin(), ray.get_normal(), std::numeric_limits<real>::max(),
+            [&](uint32_t i) {
+                return hit_distance(ray, i).has_value();
             });
+    }
+
+    void TriangleMesh::hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const {
+        m_bvh.traverse(packet, hits.distance, [&](uint32_t triangle) {
+            const auto &[e1, e2] = m_edges[triangle];
+            const auto &v0 = (*m_vertices)[m_indices[triangle][0]];
+
+            JOYTRACER_LANE_LOOP
+            for (std::size_t i = 0; i < packet_width; ++i) {
+                real dx = packet.direction[0][i], dy = packet.direction[1][i], dz = packet.direction[2][i];
+                real px = dy * e2[2] - dz * e2[1];
+                real py = dz * e2[0] - dx * e2[2];
+                real pz = dx * e2[1] - dy * e2[0];
+                real determinant = e1[0] * px + e1[1] * py + e1[2] * pz;
+                bool facing = determinant >= epsilon;
+                real inverse_determinant = 1 / (facing ? determinant : real(1));
+                real tx = packet.origin[0][i] - v0[0];
+                real ty = packet.origin[1][i] - v0[1];
+                real tz = packet.origin[2][i] - v0[2];
+                real u = (tx * px + ty * py + tz * pz) * inverse_determinant;
+                real qx = ty * e1[2] - tz * e1[1];
+                real qy = tz * e1[0] - tx * e1[2];
+                real qz = tx * e1[1] - ty * e1[0];
+                real v = (dx * qx + dy * qy + dz * qz) * inverse_determinant;
+                real distance = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * inverse_determinant;
+                bool inside = (std::min(u, v) >= 0) & (u <= 1) & (u + v <= 1);
+                hits.record(i, (packet.active[i] != 0) & facing & inside & (distance > epsilon), distance, id);
+            }
+        });
+    }
+
+    std::optional<BoundingBox> TriangleMesh::bounds() const {
+        return m_bvh.nodes().front().bounds;
+    }
+
+    Instance::Instance(
+            std::shared_ptr<const Prototype> prototype,
+            const Mat3x3 &linear,
+            const Vec3 &translation
+        ) : m_prototype(std::move(prototype)) {
+        // Relative to the volume of the box the rows span, so that a small
+        // but uniform scale passes and only flattened transforms fail.
+        auto row_volume = vector_length(linear[0]) * vector_length(linear[1]) * vector_length(linear[2]);
+
+        if (!(std::fabs(determinant(linear)) > epsilon * row_volume)) {
+            throw std::invalid_argument("Instance transform is not invertible");
+        }
+
+        auto inverse_linear = inverse(linear);
+        m_transform = std::make_shared<const Transform>(
+            Transform{translation, inverse_linear, transpose(inverse_linear)});
+
+        // The box around the transformed corners of the prototype's box.
+        auto box = m_prototype->bounds();
+
+        for (int corner = 0; corner < 8; ++corner) {
+            Vec3 point{
+                (corner & 1 ? box.max() : box.min())[0],
+                (corner & 2 ? box.max() : box.min())[1],
+                (corner & 4 ? box.max() : box.min())[2]};
+            m_bounds.extend(dot(point, linear) + translation);
+        }
+    }
+
+    std::pair<Ray, real> Instance::to_prototype(const Ray &ray) const {
+        auto direction = dot(Vec3(ray.get_normal()), m_transform->inverse);
+        auto scale = vector_length(direction);
+        return {
+            Ray(dot(ray.get_origin() - m_transform->translation, m_transform->inverse), Normal3(direction)),
+            scale};
+    }
 
-        if (nearest_hit == hits.end()) {
+    std::optional<HitResult> Instance::hit_test(const Ray &ray) const {
+        auto [object_ray, scale] = to_prototype(ray);
+        auto hit = m_prototype->hit_test(object_ray);
+
+        if (!hit) {
             return std::nullopt;
         }
 
-        return *nearest_hit;
+        auto distance = hit->distance() / scale;
+        return HitResult(
+            distance,
+            ray.get_origin() + ray.get_normal() * distance,
+            Normal3(dot(Vec3(hit->normal()), m_transform->normal_transform)),
+            hit->color());
+    }
+
+    bool Instance::occluded(const Ray &ray) const {
+        return m_prototype->occluded(to_prototype(ray).first);
+    }
+
+    void Instance::hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const {
+        Lanes<Vec3> origins;
+        Lanes<Vec3> directions;
+        Lanes<bool> active{};
+        Lanes<real> scales;
+        scales.fill(1);
+        // The prototype's kernels compare against distances in its space.
+        PacketHits object_hits;
+
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            if (!packet.active[i]) {
+                continue;
+            }
+
+            Ray object_ray(
+                Vec3{packet.origin[0][i], packet.origin[1][i], packet.origin[2][i]},
+                Normal3(Vec3{packet.direction[0][i], packet.direction[1][i], packet.direction[2][i]}));
+            std::tie(object_ray, scales[i]) = to_prototype(object_ray);
+            origins[i] = object_ray.get_origin();
+            directions[i] = object_ray.get_normal();
+            active[i] = true;
+        }
+
+        Lanes<real> object_distances;
+
+        // Retired lanes keep a negative distance.
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            object_distances[i] = hits.distance[i] * scales[i];
+        }
+
+        object_hits.distance = object_distances;
+        m_prototype->hit_test(RayPacket::from_rays(origins, directions, active), object_hits, id);
+
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            if (object_hits.distance[i] < object_distances[i]) {
+                hits.distance[i] = object_hits.distance[i] / scales[i];
+                hits.primitive[i] = id;
+            }
+        }
     }
 
-    std::vector<Vec3> hemisphere_points = ([]() -> auto {
-        const uint32_t point_count = 10;
-        std::vector<uint32_t> range(point_count);
-        std::vector<Vec3> points(point_count);
-        std:iota(range.begin(), range.end(), 0);
-        std::transform(range.begin(), range.end(), points.begin(), [=](uint32_t i){
-            auto uv = hammersley::hammersley2d(i, point_count);
-            return Vec3(hammersley::hemispheresample_uniform(uv[0], uv[1]));
+    std::optional<BoundingBox> Instance::bounds() const {
+        return m_bounds;
+    }
+
+    Prototype::Prototype(std::vector<Surface> surfaces) {
+        if (surfaces.empty()) {
+            throw std::invalid_argument("Prototype has no surfaces");
+        }
+
+        std::vector<BoundingBox> bounds;
+
+        for (const auto &s: surfaces) {
+            auto box = std::visit(BoundsVisitor(), s);
+
+            if (!box) {
+                throw std::invalid_argument("Prototypes can only hold bounded surfaces");
+            }
+
+            bounds.push_back(*box);
+        }
+
+        m_bvh = Bvh(bounds);
+        m_surfaces.reserve(surfaces.size());
+
+        for (auto i: m_bvh.primitive_order()) {
+            m_surfaces.push_back(std::move(surfaces[i]));
+        }
+    }
+
+    std::optional<HitResult> Prototype::hit_test(const Ray &ray) const {
+        std::optional<HitResult> nearest_hit;
+
+        m_bvh.traverse(ray.get_origin(), ray.get_normal(), std::numeric_limits<real>::max(),
+            [&](uint32_t i) -> std::optional<real> {
+                auto hit = std::visit(HitTestVisitor(ray), m_surfaces[i]);
+
+                if (!hit || (nearest_hit && hit->distance() >= nearest_hit->distance())) {
+                    return std::nullopt;
+                }
+
+                nearest_hit = hit;
+                return hit->distance();
+            });
+
+        return nearest_hit;
+    }
+
+    bool Prototype::occluded(const Ray &ray) const {
+        return m_bvh.any_hit(ray.get_origin(), ray.get_normal(), std::numeric_limits<real>::max(),
+            [&](uint32_t i) {
+                return std::visit(OccludedVisitor(ray), m_surfaces[i]);
+            });
+    }
+
+    void Prototype::hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const {
+        m_bvh.traverse(packet, hits.distance, [&](uint32_t i) {
+            std::visit(PacketHitTestVisitor(packet, hits, id), m_surfaces[i]);
         });
-        return points;
-    })();
+    }
 
-    Color Scene::trace_ray(const Ray &ray, int reflect) const {
-        if (reflect == 0) {
-            return Color::black();
+    BoundingBox Prototype::bounds() const {
+        return m_bvh.nodes().front().bounds;
+    }
+
+    Scene::Scene(
+        std::vector<Surface> surfaces,
+        const Color &sky_color,
+        const Normal3 &sunlight_normal
+    ) : m_sky_color(sky_color),
+    m_sunlight_normal(sunlight_normal) {
+        std::vector<BoundingBox> bounds;
+        auto bounded_surfaces = split_unbounded(std::move(surfaces), bounds);
+
+        m_bvh = Bvh(bounds);
+        m_surfaces.reserve(bounded_surfaces.size());
+        // Bounded slots still index `bounded_surfaces`, point them at the
+        // tree order.
+        std::vector<std::size_t> tree_index(bounded_surfaces.size());
+
+        for (auto i: m_bvh.primitive_order()) {
+            tree_index[i] = m_surfaces.size();
+            m_surfaces.push_back(std::move(bounded_surfaces[i]));
         }
 
-        auto nearest_hit = trace_single_ray(ray);
+        for (auto &slot: m_surface_slots) {
+            if (slot.bounded) {
+                slot.index = tree_index[slot.index];
+            }
+        }
+    }
 
-        if (!nearest_hit) {
-            auto sun_exposure = (1.0 - dot(ray.get_normal(), m_sunlight_normal)) / 2.0;
-            sun_exposure = sun_exposure >= 0.999 ? 1.0 : sun_exposure / 2.0;
-            return Color::weighted_blend(m_sky_color, Color::white(), 1.0 - sun_exposure, sun_exposure);
+    Scene::Scene(
+        std::vector<Surface> surfaces,
+        const Color &sky_color,
+        const Normal3 &sunlight_normal,
+        Bvh bvh
+    ) : m_bvh(std::move(bvh)),
+    m_sky_color(sky_color),
+    m_sunlight_normal(sunlight_normal) {
+        std::vector<BoundingBox> bounds;
+        m_surfaces = split_unbounded(std::move(surfaces), bounds);
+
+        if (m_surfaces.size() != m_bvh.primitive_order().size()) {
+            throw std::runtime_error("Scene Bvh does not match its surfaces");
         }
+    }
 
-        auto base_color = nearest_hit->color();
-        auto reflection_color = trace_ray(Ray(
-            nearest_hit->point(),
-            Normal3(ray.get_normal() + nearest_hit->normal() * (std::fabs(dot(ray.get_normal(), nearest_hit->normal())) * 2))
-        ), reflect - 1);
+    std::vector<Surface> Scene::split_unbounded(std::vector<Surface> surfaces, std::vector<BoundingBox> &bounds) {
+        std::vector<Surface> bounded_surfaces;
 
-        bool direct_light = !trace_single_ray(Ray(
-            nearest_hit->point(),
-            Normal3(m_sunlight_normal * -1.0)
-        ));
+        for (auto &s: surfaces) {
+            auto box = std::visit(BoundsVisitor(), s);
 
-        if (direct_light) {
-            return Color::substractive_mix(
-                base_color,
-                Color::weighted_blend(Color::white(), reflection_color, 1, 1)
-            );
+            if (box) {
+                m_surface_slots.push_back({true, bounded_surfaces.size()});
+                bounded_surfaces.push_back(std::move(s));
+                bounds.push_back(*box);
+            } else {
+                m_surface_slots.push_back({false, m_unbounded_surfaces.size()});
+                m_unbounded_surfaces.push_back(std::move(s));
+            }
+        }
+
+        return bounded_surfaces;
+    }
+
+    void Scene::replace_surfaces(std::vector<std::pair<std::size_t, Surface>> surfaces) {
+        bool refit = false;
+
+        for (auto &[index, surface]: surfaces) {
+            if (index >= m_surface_slots.size()) {
+                throw std::invalid_argument("No surface " + std::to_string(index) + " to replace");
+            }
+
+            const auto &slot = m_surface_slots[index];
+
+            if (std::visit(BoundsVisitor(), surface).has_value() != slot.bounded) {
+                throw std::invalid_argument("Surface " + std::to_string(index) + " changed whether it is bounded");
+            }
+
+            (slot.bounded ? m_surfaces : m_unbounded_surfaces)[slot.index] = std::move(surface);
+            refit |= slot.bounded;
+        }
+
+        if (!refit) {
+            return;
+        }
+
+        std::vector<BoundingBox> bounds;
+        bounds.reserve(m_surfaces.size());
+
+        for (const auto &s: m_surfaces) {
+            bounds.push_back(*std::visit(BoundsVisitor(), s));
+        }
+
+        m_bvh.refit(bounds);
+    }
+
+    namespace {
+        static_assert(std::variant_size_v<Surface> == RenderCounters::surface_type_count,
+            "RenderCounters needs a slot per Surface alternative");
+
+        void count_test(RenderCounters *counters, const Surface &surface, bool hit) {
+            if (counters) {
+                ++counters->tests[surface.index()];
+                counters->hits[surface.index()] += hit;
+            }
+        }
+    }
+
+    std::optional<HitResult> Scene::trace_single_ray(const Ray &ray) const {
+        std::optional<HitResult> nearest_hit;
+        auto *counters = this->counters();
+
+        for (const auto &s: m_unbounded_surfaces) {
+            auto h = std::visit(HitTestVisitor(ray), s);
+            auto nearer = h && (!nearest_hit || h->distance() < nearest_hit->distance());
+            count_test(counters, s, nearer);
+
+            if (nearer) {
+                nearest_hit = h;
+            }
         }
 
+        m_bvh.traverse(ray.get_origin(), ray.get_normal(),
+            nearest_hit ? nearest_hit->distance() : std::numeric_limits<real>::max(),
+            [&](uint32_t i) -> std::optional<real> {
+                auto h = std::visit(HitTestVisitor(ray), m_surfaces[i]);
+                auto nearer = h && (!nearest_hit || h->distance() < nearest_hit->distance());
+                count_test(counters, m_surfaces[i], nearer);
+
+                if (!nearer) {
+                    return std::nullopt;
+                }
+
+                nearest_hit = h;
+                return h->distance();
+            });
+
+        return nearest_hit;
+    }
+
+    Color Scene::sky_color(const Ray &ray) const {
+        auto sun_exposure = (1 - dot(ray.get_normal(), m_sunlight_normal)) / 2;
+        sun_exposure = sun_exposure >= real(0.999) ? 1 : sun_exposure / 2;
+        return Color::weighted_blend(m_sky_color, Color::white(), 1 - sun_exposure, sun_exposure);
+    }
+
+    Ray Scene::reflection_ray(const Ray &ray, const HitResult &hit) {
+        return Ray(
+            hit.point(),
+            Normal3(ray.get_normal() + hit.normal() * (std::fabs(dot(ray.get_normal(), hit.normal())) * 2))
+        );
+    }
+
+    Mat3x3 Scene::diffuse_basis(const HitResult &hit) {
         auto orthonormal_matrix = normal_to_orthonormal_matrix(
-            nearest_hit->normal(), nearest_hit->normal().to_orthogonal()
+            hit.normal(), hit.normal().to_orthogonal()
         );
         // WTF?
         std::rotate(orthonormal_matrix.begin(), orthonormal_matrix.begin() + 1, orthonormal_matrix.end());
-        std::vector<Color> diffuse_light_rays(hemisphere_points.size());
-        std::transform(
-            hemisphere_points.begin(),
-            hemisphere_points.end(),
-            diffuse_light_rays.begin(),
-            [&](const auto &hemisphere_point) -> auto {
-                return trace_ray(Ray(
-                    nearest_hit->point(),
-                    Normal3(dot(hemisphere_point, orthonormal_matrix))
-                ), reflect - 1);
-        });
-        auto diffuse_light = Color::blend(diffuse_light_rays);
+        return orthonormal_matrix;
+    }
+
+    Ray Scene::diffuse_ray(const HitResult &hit, const Mat3x3 &basis,
+        const HemisphereSampler::Rotation &rotation, std::size_t index) const {
+        return Ray(hit.point(), Normal3(dot(m_sampler.direction(index, rotation), basis)));
+    }
+
+    Color Scene::shade(const Ray &ray, const HitResult &hit, bool direct_light, int reflect) const {
+        auto base_color = hit.color();
+        auto reflection_color = trace_ray(reflection_ray(ray, hit), reflect - 1);
+
+        if (direct_light) {
+            return Color::substractive_mix(
+                base_color,
+                Color::weighted_blend(Color::white(), reflection_color, 1, 1)
+            );
+        }
 
         return Color::substractive_mix(
             base_color,
-            Color::weighted_blend(diffuse_light, reflection_color, 1, 1)
+            Color::weighted_blend(diffuse_light(hit, reflect), reflection_color, 1, 1)
         );
     }
 
+    Color Scene::diffuse_light(const HitResult &hit, int reflect) const {
+        auto basis = diffuse_basis(hit);
+        auto rotation = m_sampler.rotation(hit.point(), reflect);
+        ColorAccumulator light;
+
+        // One bounce left means black diffuse rays, not worth a record.
+        if (!m_irradiance_cache || reflect <= 1) {
+            for (std::size_t i = 0; i < diffuse_ray_count(); ++i) {
+                light.add(trace_ray(diffuse_ray(hit, basis, rotation, i), reflect - 1));
+            }
+
+            return light.average();
+        }
+
+        auto cached = m_irradiance_cache->lookup(hit.point(), hit.normal(), reflect);
+
+        if (cached) {
+            return *cached;
+        }
+
+        // The record's radius is the harmonic mean distance of the hits,
+        // so records near other geometry only cover a small area.
+        real inverse_distances = 0;
+
+        for (std::size_t i = 0; i < diffuse_ray_count(); ++i) {
+            RayDepthScope depth(counters());
+            auto ray = diffuse_ray(hit, basis, rotation, i);
+            auto nearest_hit = trace_single_ray(ray);
+
+            if (nearest_hit) {
+                inverse_distances += 1 / std::max(nearest_hit->distance(), epsilon);
+            }
+
+            light.add(incoming_light(ray, nearest_hit, reflect - 1));
+        }
+
+        m_irradiance_cache->insert(hit.point(), hit.normal(), reflect,
+            inverse_distances > 0 ?
+                static_cast<real>(diffuse_ray_count()) / inverse_distances :
+                std::numeric_limits<real>::max(),
+            light.average());
+
+        return light.average();
+    }
+
+    Color Scene::trace_ray(const Ray &ray, int reflect) const {
+        if (reflect == 0) {
+            return Color::black();
+        }
+
+        RayDepthScope depth(counters());
+        return incoming_light(ray, trace_single_ray(ray), reflect);
+    }
+
+    Color Scene::incoming_light(const Ray &ray, const std::optional<HitResult> &nearest_hit, int reflect) const {
+        if (!nearest_hit) {
+            return sky_color(ray);
+        }
+
+        bool direct_light = !occluded(Ray(
+            nearest_hit->point(),
+            Normal3(m_sunlight_normal * real(-1))
+        ));
+
+        return shade(ray, *nearest_hit, direct_light, reflect);
+    }
+
+    void Scene::packet_hit_test(const Surface &surface, const RayPacket &packet,
+        PacketHits &hits, lane_int id, RenderCounters *counters) {
+        if (!counters) {
+            std::visit(PacketHitTestVisitor(packet, hits, id), surface);
+            return;
+        }
+
+        // Retired shadow lanes have a negative distance.
+        auto primitive = hits.primitive;
+        auto distance = hits.distance;
+        std::visit(PacketHitTestVisitor(packet, hits, id), surface);
+
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            auto tested = packet.active[i] && distance[i] > 0;
+            counters->tests[surface.index()] += tested;
+            counters->hits[surface.index()] += tested && hits.primitive[i] != primitive[i];
+        }
+    }
+
+    void Scene::trace_packet_hits(const RayPacket &packet, PacketHits &hits) const {
+        lane_int id = 0;
+        auto *counters = this->counters();
+
+        for (const auto &s: m_unbounded_surfaces) {
+            packet_hit_test(s, packet, hits, id++, counters);
+        }
+
+        m_bvh.traverse(packet, hits.distance, [&](uint32_t i) {
+            packet_hit_test(m_surfaces[i], packet, hits, id + i, counters);
+        });
+    }
+
+    bool Scene::occluded(const Ray &ray) const {
+        auto *counters = this->counters();
+
+        if (counters) {
+            ++counters->shadow_rays;
+        }
+
+        for (const auto &s: m_unbounded_surfaces) {
+            auto blocked = std::visit(OccludedVisitor(ray), s);
+            count_test(counters, s, blocked);
+
+            if (blocked) {
+                return true;
+            }
+        }
+
+        return m_bvh.any_hit(ray.get_origin(), ray.get_normal(), std::numeric_limits<real>::max(),
+            [&](uint32_t i) {
+                auto blocked = std::visit(OccludedVisitor(ray), m_surfaces[i]);
+                count_test(counters, m_surfaces[i], blocked);
+                return blocked;
+            });
+    }
+
+    Lanes<lane_int> Scene::occluded(const RayPacket &packet) const {
+        // The packet kernels find any hit just as well. Once a lane is hit,
+        // a negative max distance takes it out of the kernels and the box
+        // tests, and the walk ends when no lane is left.
+        PacketHits hits;
+        auto retire_hit_lanes = [&]() {
+            JOYTRACER_LANE_LOOP
+            for (std::size_t i = 0; i < packet_width; ++i) {
+                hits.distance[i] = hits.primitive[i] != PacketHits::no_hit ? real(-1) : hits.distance[i];
+            }
+        };
+
+        auto *counters = this->counters();
+
+        if (counters) {
+            counters->shadow_rays += std::count(packet.active.begin(), packet.active.end(), lane_int(1));
+        }
+
+        for (const auto &s: m_unbounded_surfaces) {
+            packet_hit_test(s, packet, hits, 0, counters);
+        }
+
+        retire_hit_lanes();
+        m_bvh.traverse(packet, hits.distance, [&](uint32_t i) {
+            packet_hit_test(m_surfaces[i], packet, hits, 0, counters);
+            retire_hit_lanes();
+        });
+
+        Lanes<lane_int> blocked;
+
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            blocked[i] = hits.primitive[i] != PacketHits::no_hit;
+        }
+
+        return blocked;
+    }
+
+    const Surface &Scene::hit_surface(lane_int id) const {
+        auto index = static_cast<std::size_t>(id);
+        return index < m_unbounded_surfaces.size() ?
+            m_unbounded_surfaces[index] :
+            m_surfaces[index - m_unbounded_surfaces.size()];
+    }
+
+    Lanes<Color> Scene::trace_packet(const RayPacket &packet, int reflect) const {
+        Lanes<Color> colors;
+
+        if (reflect == 0) {
+            return colors;
+        }
+
+        auto *counters = this->counters();
+        RayDepthScope depth(counters,
+            counters ? std::count(packet.active.begin(), packet.active.end(), lane_int(1)) : 0);
+        PacketHits hits;
+        trace_packet_hits(packet, hits);
+
+        // Kernels only find distances; build full hit results for the
+        // winners, then trace all shadow rays toward the sun as a packet.
+        Lanes<std::optional<Ray>> rays;
+        Lanes<std::optional<HitResult>> nearest_hits;
+        Lanes<Vec3> shadow_origins;
+        Lanes<Vec3> shadow_directions;
+        Lanes<bool> shadowed_lanes{};
+
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            if (!packet.active[i]) {
+                continue;
+            }
+
+            rays[i].emplace(
+                Vec3{packet.origin[0][i], packet.origin[1][i], packet.origin[2][i]},
+                Normal3(Vec3{packet.direction[0][i], packet.direction[1][i], packet.direction[2][i]}));
+
+            if (hits.primitive[i] != PacketHits::no_hit) {
+                nearest_hits[i] = std::visit(HitTestVisitor(*rays[i]), hit_surface(hits.primitive[i]));
+
+                // The kernels round differently, so on an edge the winner
+                // may miss here. Let the scalar search decide.
+                if (!nearest_hits[i]) {
+                    nearest_hits[i] = trace_single_ray(*rays[i]);
+                }
+            }
+
+            if (!nearest_hits[i]) {
+                colors[i] = sky_color(*rays[i]);
+                continue;
+            }
+
+            shadow_origins[i] = nearest_hits[i]->point();
+            shadow_directions[i] = m_sunlight_normal * real(-1);
+            shadowed_lanes[i] = true;
+        }
+
+        auto blocked = occluded(RayPacket::from_rays(shadow_origins, shadow_directions, shadowed_lanes));
+
+        for (std::size_t i = 0; i < packet_width; ++i) {
+            if (!nearest_hits[i]) {
+                continue;
+            }
+
+            colors[i] = shade(*rays[i], *nearest_hits[i], !blocked[i], reflect);
+        }
+
+        return colors;
+    }
+
     void Camera::set_orientation(const std::array<double, 3> &orientation) {
-        double horizontal_length = std::cos(orientation[0]);
-        double yaw_cos = std::cos(orientation[1]);
-        double yaw_sin = std::sin(orientation[1]);
+        real horizontal_length = std::cos(orientation[0]);
+        real yaw_cos = std::cos(orientation[1]);
+        real yaw_sin = std::sin(orientation[1]);
         Normal3 lookat(Vec3{
             horizontal_length * yaw_cos,
             horizontal_length * yaw_sin,
-            std::sin(orientation[0])
+            static_cast<real>(std::sin(orientation[0]))
         });
         Normal3 left(Vec3{
             -yaw_sin,
             yaw_cos,
-            0.0
+            0
         });
         m_view_transform = normal_to_orthonormal_matrix(lookat, left);
         m_orientation = orientation;
     }
 
+    Ray Camera::primary_ray(int width, int height, real x, real y) const {
+        x += m_pixel_offset[0];
+        y += m_pixel_offset[1];
+        real surface_y = m_plane_height * (real(0.5) - y / height);
+        real surface_x = m_plane_width * (x / width - real(0.5));
+        return Ray(
+            m_position,
+            dot(Normal3(Vec3{m_focal_distance, -surface_x, surface_y}), m_view_transform)
+        );
+    }
+
+    void Camera::render_tile(const Scene &scene, int width, int height, const PixelRegion &tile,
+        const std::vector<uint8_t> *mask, const PixelRegion &frame_region, std::vector<Color> &frame) const {
+        auto wanted = [&](int x, int y) {
+            return !mask || (*mask)[y * width + x];
+        };
+        auto pixel = [&](int x, int y) -> Color & {
+            return frame[(y - frame_region.y_begin) * frame_region.width() + x - frame_region.x_begin];
+        };
+
+        if (m_wavefront) {
+            // Reused by every tile rendered on this thread.
+            thread_local Wavefront wavefront;
+            std::vector<Ray> rays;
+            std::vector<Color> colors;
+            rays.reserve(tile.size());
+
+            for (int y = tile.y_begin; y < tile.y_end; ++y) {
+                for (int x = tile.x_begin; x < tile.x_end; ++x) {
+                    if (wanted(x, y)) {
+                        rays.push_back(primary_ray(width, height, x, y));
+                    }
+                }
+            }
+
+            wavefront.trace(scene, rays, m_reflections, colors);
+            auto color = colors.begin();
+
+            for (int y = tile.y_begin; y < tile.y_end; ++y) {
+                for (int x = tile.x_begin; x < tile.x_end; ++x) {
+                    if (wanted(x, y)) {
+                        pixel(x, y) = *color++;
+                    }
+                }
+            }
+
+            return;
+        }
+
+        if (!m_ray_packets) {
+            for (int y = tile.y_begin; y < tile.y_end; ++y) {
+                for (int x = tile.x_begin; x < tile.x_end; ++x) {
+                    if (wanted(x, y)) {
+                        pixel(x, y) = scene.trace_ray(primary_ray(width, height, x, y), m_reflections);
+                    }
+                }
+            }
+
+            return;
+        }
+
+        // Packets of horizontally adjacent pixels.
+        const auto lanes = static_cast<int>(packet_width);
+
+        for (int y = tile.y_begin; y < tile.y_end; ++y) {
+            for (int x = tile.x_begin; x < tile.x_end; x += lanes) {
+                Lanes<Vec3> origins;
+                Lanes<Vec3> directions;
+                Lanes<bool> active{};
+
+                for (int i = 0; i < lanes && x + i < tile.x_end; ++i) {
+                    if (!wanted(x + i, y)) {
+                        continue;
+                    }
+
+                    auto ray = primary_ray(width, height, x + i, y);
+                    origins[i] = ray.get_origin();
+                    directions[i] = ray.get_normal();
+                    active[i] = true;
+                }
+
+                if (std::none_of(active.begin(), active.end(), [](bool a) { return a; })) {
+                    continue;
+                }
+
+                auto colors = scene.trace_packet(RayPacket::from_rays(origins, directions, active), m_reflections);
+
+                for (int i = 0; i < lanes && x + i < tile.x_end; ++i) {
+                    if (active[i]) {
+                        pixel(x + i, y) = colors[i];
+                    }
+                }
+            }
+        }
+    }
+
     std::vector<Color> Camera::render_scene(const Scene &scene, int width, int height) {
+        PixelRegion all{0, 0, width, height};
+        std::vector<Color> frame(width * height);
+        render_tile(scene, width, height, all, nullptr, all, frame);
+        return frame;
+    }
+
+    std::vector<Color> Camera::render_scene(const Scene &scene, int width, int height,
+        ThreadPool &pool, int tile_size) {
         std::vector<Color> frame(width * height);
+        render_tiles(scene, width, height, {0, 0, width, height}, pool, tile_size, nullptr, frame);
+        return frame;
+    }
+
+    std::vector<Color> Camera::render_scene(const Scene &scene, int width, int height,
+        const PixelRegion &region, int first_sample, int sample_count,
+        ThreadPool &pool, int tile_size) const {
+        if (region.x_begin < 0 || region.y_begin < 0 || region.x_end > width || region.y_end > height ||
+            region.width() <= 0 || region.height() <= 0) {
+            throw std::out_of_range("Region outside of the image");
+        }
 
-        for (int y = 0; y < height; ++y) {
-            double surface_y = m_plane_height * (0.5 - static_cast<double>(y) / height);
+        std::vector<ColorAccumulator> samples(region.size());
+        std::vector<Color> pass(region.size());
+        // Jitters a copy, so this camera stays as it was even if a tile
+        // throws.
+        auto jittered = *this;
 
-            for (int x = 0; x < width; ++x) {
-                double surface_x = m_plane_width * (static_cast<double>(x) / width - 0.5);
-                frame[y * width + x] = scene.trace_ray(Ray(
-                    m_position,
-                    dot(Normal3(Vec3{m_focal_distance, -surface_x, surface_y}), m_view_transform)
-                ), 4);
+        for (int i = first_sample; i < first_sample + sample_count; ++i) {
+            auto offset = hammersley::halton2d(static_cast<uint32_t>(i));
+            jittered.m_pixel_offset = {static_cast<real>(offset[0]), static_cast<real>(offset[1])};
+            jittered.render_tiles(scene, width, height, region, pool, tile_size, nullptr, pass);
+
+            for (std::size_t j = 0; j < pass.size(); ++j) {
+                samples[j].add(pass[j]);
             }
         }
 
-        return frame;
+        std::transform(samples.begin(), samples.end(), pass.begin(),
+            [](const auto &pixel_samples) { return pixel_samples.average(); });
+        return pass;
     }
 
-    Color Camera::test_point(const Scene &scene, int width, int height, int x, int y) {
-        double surface_y = m_plane_height * (0.5 - static_cast<double>(y) / height);
-        double surface_x = m_plane_width * (static_cast<double>(x) / width - 0.5);
-        return scene.trace_ray(Ray(
-            m_position,
-            dot(Normal3(Vec3{m_focal_distance, -surface_x, surface_y}), m_view_transform)
-        ), 4);
+    void Camera::render_pixels(const Scene &scene, int width, int height,
+        ThreadPool &pool, const std::vector<uint8_t> &mask, std::vector<Color> &frame,
+        int tile_size) {
+        render_tiles(scene, width, height, {0, 0, width, height}, pool, tile_size, &mask, frame);
+    }
+
+    void Camera::render_tiles(const Scene &scene, int width, int height, const PixelRegion &region,
+        ThreadPool &pool, int tile_size,
+        const std::vector<uint8_t> *mask, std::vector<Color> &frame) const {
+        if (tile_size <= 0) {
+            throw std::invalid_argument("Tile size must be positive, got " + std::to_string(tile_size));
+        }
+
+        std::vector<ThreadPool::Task> tiles;
+
+        for (int y = region.y_begin; y < region.y_end; y += tile_size) {
+            for (int x = region.x_begin; x < region.x_end; x += tile_size) {
+                tiles.push_back([&, x, y]() {
+                    PixelRegion tile{x, y, std::min(x + tile_size, region.x_end), std::min(y + tile_size, region.y_end)};
+                    render_tile(scene, width, height, tile, mask, region, frame);
+                });
+            }
+        }
+
+        pool.run(std::move(tiles));
+    }
+
+    Color Camera::test_point(const Scene &scene, int width, int height, int x, int y) const {
+        return scene.trace_ray(primary_ray(width, height, x, y), m_reflections);
     }
 } // namespace joytracer
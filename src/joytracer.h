@@ -1,16 +1,27 @@
 #pragma once
 #include <array>
+#include <cstdint>
 #include <vector>
 #include <optional>
 #include <memory>
+#include <string>
+#include <utility>
 #include <variant>
 
+#include "bvh.h"
 #include "joymath.h"
+#include "ray_packet.h"
+#include "render_stats.h"
+#include "sampler.h"
+#include "thread_pool.h"
 
 /*
 * Main namespace for the app.
 */
 namespace joytracer {
+    class IrradianceCache;
+    class Wavefront;
+
     /*
     * A ray cast out into the scene.
     */
@@ -38,15 +49,15 @@ namespace joytracer {
     */
     class HitPoint {
     private:
-        double m_distance;
+        real m_distance;
         Vec3 m_point;
     public:
         HitPoint(
-            double distance,
+            real distance,
             const Vec3 &point
         ) : m_distance(distance), m_point(point) {}
 
-        double distance() const {
+        real distance() const {
             return m_distance;
         }
 
@@ -55,24 +66,32 @@ namespace joytracer {
         }
     };
 
+    /*
+    * Intersects a ray with the front face of a plane.
+    */
+    std::optional<HitPoint> project_ray_on_plane_frontface(
+        const Ray &ray,
+        const Vec3 &plane_origin,
+        const Normal3 &plane_normal);
+
     /*
     * The result of casting a ray and successfully hitting a surface.
     */
     class HitResult {
     private:
-        double m_distance;
+        real m_distance;
         Vec3 m_point;
         Normal3 m_normal;
         Color m_color;
     public:
         HitResult(
-            double distance,
+            real distance,
             const Vec3 &point,
             const Normal3 &normal,
             const Color &color
         ) : m_distance(distance), m_point(point), m_normal(normal), m_color(color) {}
 
-        double distance() const {
+        real distance() const {
             return m_distance;
         }
 
@@ -97,12 +116,25 @@ namespace joytracer {
         std::array<Vec3, 3> m_vertices;
         Color m_color;
         Normal3 m_normal;
+
+        bool contains(const Vec3 &point) const;
     public:
         Triangle(
             const std::array<Vec3, 3> &vertices,
             const Color &color
         );
         std::optional<HitResult> hit_test(const Ray &ray) const;
+        bool occluded(const Ray &ray) const;
+        void hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const;
+        std::optional<BoundingBox> bounds() const;
+
+        const std::array<Vec3, 3> &vertices() const {
+            return m_vertices;
+        }
+
+        const Color &color() const {
+            return m_color;
+        }
     };
 
     /*
@@ -113,6 +145,13 @@ namespace joytracer {
         Floor() {}
         ~Floor() {}
         std::optional<HitResult> hit_test(const Ray &ray) const;
+        bool occluded(const Ray &ray) const;
+        void hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const;
+
+        // The floor is unbounded.
+        std::optional<BoundingBox> bounds() const {
+            return std::nullopt;
+        }
     };
 
     /*
@@ -120,23 +159,144 @@ namespace joytracer {
     */
     class Sphere {
     private:
-        double m_radius;
+        real m_radius;
         Vec3 m_center;
         Color m_color;
+
+        std::optional<real> hit_distance(const Ray &ray) const;
     public:
-        Sphere(double radius, Vec3 center, Color color) :
+        Sphere(real radius, Vec3 center, Color color) :
             m_radius(radius),
             m_center(center),
             m_color(color)
         {}
         ~Sphere() {}
         std::optional<HitResult> hit_test(const Ray &ray) const;
+        bool occluded(const Ray &ray) const;
+        void hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const;
+        std::optional<BoundingBox> bounds() const;
+
+        real radius() const {
+            return m_radius;
+        }
+
+        const Vec3 &center() const {
+            return m_center;
+        }
+
+        const Color &color() const {
+            return m_color;
+        }
+    };
+
+    /*
+    * A mesh of triangles sharing one indexed vertex buffer.
+    *
+    * Each triangle keeps its vertex indices and its two edges from the
+    * first vertex, ready for the Möller–Trumbore test, and the mesh holds
+    * its own Bvh over them. Like `Triangle`, only front faces are hit,
+    * where vertices go counterclockwise.
+    */
+    class TriangleMesh {
+    private:
+        std::shared_ptr<const std::vector<Vec3>> m_vertices;
+        std::vector<std::array<uint32_t, 3>> m_indices;
+        std::vector<std::array<Vec3, 2>> m_edges;
+        Bvh m_bvh;
+        Color m_color;
+
+        std::optional<real> hit_distance(const Ray &ray, uint32_t triangle) const;
+        void compute_edges();
+    public:
+        // Both throw `std::invalid_argument` without triangles, which
+        // would leave the mesh without bounds.
+        TriangleMesh(
+            std::shared_ptr<const std::vector<Vec3>> vertices,
+            std::vector<std::array<uint32_t, 3>> indices,
+            const Color &color
+        );
+        // Uses a prebuilt `bvh`, with `indices` already in its order.
+        TriangleMesh(
+            std::shared_ptr<const std::vector<Vec3>> vertices,
+            std::vector<std::array<uint32_t, 3>> indices,
+            const Color &color,
+            Bvh bvh
+        );
+        std::optional<HitResult> hit_test(const Ray &ray) const;
+        bool occluded(const Ray &ray) const;
+        void hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const;
+        std::optional<BoundingBox> bounds() const;
+
+        std::size_t triangle_count() const {
+            return m_indices.size();
+        }
+
+        const std::shared_ptr<const std::vector<Vec3>> &vertices() const {
+            return m_vertices;
+        }
+
+        // In `bvh()` order.
+        const std::vector<std::array<uint32_t, 3>> &indices() const {
+            return m_indices;
+        }
+
+        const Bvh &bvh() const {
+            return m_bvh;
+        }
+
+        const Color &color() const {
+            return m_color;
+        }
+    };
+
+    class Prototype;
+
+    /*
+    * A placed copy of a `Prototype`, shared with every other instance of
+    * it. Rays are moved into the prototype's own space for the test, so
+    * a copy costs a transform instead of its geometry.
+    *
+    * The transform takes prototype points to the scene as
+    * `dot(point, linear) + translation`, and must be invertible. Its
+    * matrices live on the heap, so that an instance makes no `Surface`
+    * larger.
+    */
+    class Instance {
+    private:
+        struct Transform {
+            Vec3 translation;
+            Mat3x3 inverse;
+            // Takes normals out of the prototype, the inverse transpose.
+            Mat3x3 normal_transform;
+        };
+
+        std::shared_ptr<const Prototype> m_prototype;
+        std::shared_ptr<const Transform> m_transform;
+        BoundingBox m_bounds;
+
+        // The ray in prototype space, and how much longer its direction
+        // got there, to convert distances.
+        std::pair<Ray, real> to_prototype(const Ray &ray) const;
+    public:
+        Instance(
+            std::shared_ptr<const Prototype> prototype,
+            const Mat3x3 &linear,
+            const Vec3 &translation
+        );
+        std::optional<HitResult> hit_test(const Ray &ray) const;
+        bool occluded(const Ray &ray) const;
+        void hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const;
+        std::optional<BoundingBox> bounds() const;
+
+        const std::shared_ptr<const Prototype> &prototype() const {
+            return m_prototype;
+        }
     };
 
     /*
     * Any kind of surface.
     */
-    using Surface = std::variant<Triangle, Floor, Sphere>;
+    using Surface = std::variant<Triangle, Floor, Sphere, TriangleMesh, Instance>;
 
     /*
     * A visitor to call the hit_test function of a Surface.
@@ -153,25 +313,233 @@ namespace joytracer {
         const Ray& m_ray;
     };
 
+    /*
+    * A visitor to call the occluded function of a Surface.
+    */
+    class OccludedVisitor {
+    public:
+        template<typename TSurface>
+        bool operator()(const TSurface &surface) {
+            return surface.occluded(m_ray);
+        }
+
+        OccludedVisitor(const Ray& ray) : m_ray(ray) {}
+    private:
+        const Ray& m_ray;
+    };
+
+    /*
+    * A visitor to call the packet hit_test function of a Surface, which
+    * records its hits in `hits` as `id`.
+    */
+    class PacketHitTestVisitor {
+    public:
+        template<typename TSurface>
+        void operator()(const TSurface &surface) {
+            surface.hit_test(m_packet, m_hits, m_id);
+        }
+
+        PacketHitTestVisitor(const RayPacket &packet, PacketHits &hits, lane_int id) :
+            m_packet(packet), m_hits(hits), m_id(id) {}
+    private:
+        const RayPacket &m_packet;
+        PacketHits &m_hits;
+        lane_int m_id;
+    };
+
+    /*
+    * A visitor to call the bounds function of a Surface.
+    */
+    class BoundsVisitor {
+    public:
+        template<typename TSurface>
+        std::optional<BoundingBox> operator()(const TSurface &surface) {
+            return surface.bounds();
+        }
+    };
+
+    /*
+    * A group of bounded surfaces with its own Bvh, placed in a scene any
+    * number of times through `Instance`. Its surfaces, which may be
+    * instances too, are kept in `m_bvh` order. All of them report hits
+    * as the instance.
+    */
+    class Prototype {
+    private:
+        std::vector<Surface> m_surfaces;
+        Bvh m_bvh;
+    public:
+        // Throws `std::invalid_argument` on an unbounded surface, or
+        // without any, which would leave instances without bounds.
+        explicit Prototype(std::vector<Surface> surfaces);
+        std::optional<HitResult> hit_test(const Ray &ray) const;
+        bool occluded(const Ray &ray) const;
+        void hit_test(const RayPacket &packet, PacketHits &hits, lane_int id) const;
+        BoundingBox bounds() const;
+
+        const std::vector<Surface> &surfaces() const {
+            return m_surfaces;
+        }
+    };
+
     /*
     * The scene, holding all models and surfaces.
+    *
+    * Bounded surfaces are kept in `m_bvh` order, unbounded ones like the
+    * floor are tested against every ray.
     */
     class Scene {
     private:
         std::vector<Surface> m_surfaces;
+        std::vector<Surface> m_unbounded_surfaces;
+        Bvh m_bvh;
+        // Where each surface the scene was built from went: its index in
+        // `m_surfaces`, or in `m_unbounded_surfaces`.
+        struct SurfaceSlot {
+            bool bounded;
+            std::size_t index;
+        };
+        std::vector<SurfaceSlot> m_surface_slots;
         Color m_sky_color;
         Normal3 m_sunlight_normal;
+        HemisphereSampler m_sampler;
+        std::shared_ptr<IrradianceCache> m_irradiance_cache;
+        std::shared_ptr<RenderStats> m_stats;
+
+        // The calling thread's counters, null without statistics.
+        RenderCounters *counters() const {
+            return m_stats ? &m_stats->local() : nullptr;
+        }
 
         std::optional<HitResult> trace_single_ray(const Ray &ray) const;
+        void trace_packet_hits(const RayPacket &packet, PacketHits &hits) const;
+        // Runs the packet kernel of `surface`, and counts its tests and
+        // hits if `counters` is set.
+        static void packet_hit_test(const Surface &surface, const RayPacket &packet,
+            PacketHits &hits, lane_int id, RenderCounters *counters);
+        const Surface &hit_surface(lane_int id) const;
+        Color sky_color(const Ray &ray) const;
+        // The light coming back along `ray`, whose nearest hit is `nearest_hit`.
+        Color incoming_light(const Ray &ray, const std::optional<HitResult> &nearest_hit, int reflect) const;
+        Color shade(const Ray &ray, const HitResult &hit, bool direct_light, int reflect) const;
+        // The average light of the diffuse rays of a shadowed hit, from the
+        // irradiance cache when there is one.
+        Color diffuse_light(const HitResult &hit, int reflect) const;
+
+        // The secondary rays of a hit: one mirror reflection, plus
+        // `diffuse_ray_count()` rays over the hemisphere when it is in
+        // shadow, turned by the sampler rotation of the hit.
+        static Ray reflection_ray(const Ray &ray, const HitResult &hit);
+        static Mat3x3 diffuse_basis(const HitResult &hit);
+        Ray diffuse_ray(const HitResult &hit, const Mat3x3 &basis,
+            const HemisphereSampler::Rotation &rotation, std::size_t index) const;
+
+        std::size_t diffuse_ray_count() const {
+            return m_sampler.sample_count();
+        }
+
+        // Moves the unbounded surfaces to `m_unbounded_surfaces`, and
+        // returns the others along with their bounds.
+        std::vector<Surface> split_unbounded(std::vector<Surface> surfaces, std::vector<BoundingBox> &bounds);
+
+        // Runs the same shading as `trace_ray`, one stage at a time.
+        friend class Wavefront;
+        // Writes the surfaces in BVH order along with the tree.
+        friend void save_binary_scene(const Scene &scene, const std::string &filename);
     public:
         Scene(
             std::vector<Surface> surfaces,
             const Color &sky_color,
             const Normal3 &sunlight_normal
-        ) : m_surfaces(std::move(surfaces)),
-        m_sky_color(sky_color),
-        m_sunlight_normal(sunlight_normal) {}
+        );
+        // Uses a prebuilt `bvh`, with the bounded `surfaces` already in its
+        // order.
+        Scene(
+            std::vector<Surface> surfaces,
+            const Color &sky_color,
+            const Normal3 &sunlight_normal,
+            Bvh bvh
+        );
         Color trace_ray(const Ray &ray, int reflect) const;
+
+        // Replaces surfaces, each given with its index in the list the
+        // scene was built from, and refits the BVH around them instead of
+        // rebuilding it. A surface must stay bounded or unbounded, throws
+        // `std::invalid_argument` otherwise. The irradiance cache must be
+        // cleared afterwards.
+        void replace_surfaces(std::vector<std::pair<std::size_t, Surface>> surfaces);
+
+        void set_sky_color(const Color &sky_color) {
+            m_sky_color = sky_color;
+        }
+
+        void set_sunlight_normal(const Normal3 &sunlight_normal) {
+            m_sunlight_normal = sunlight_normal;
+        }
+
+        // Picks the diffuse ray directions of shadowed hits. The default
+        // casts 10 cosine weighted rays, rotated at every hit. The
+        // irradiance cache must be cleared after a change.
+        void set_sampler(const HemisphereSampler &sampler) {
+            m_sampler = sampler;
+        }
+
+        const HemisphereSampler &sampler() const {
+            return m_sampler;
+        }
+
+        // Shares diffuse light between nearby shadowed hits, see
+        // `IrradianceCache`. Null, the default, traces every hit's
+        // hemisphere. The cache must be cleared if the scene changes.
+        void set_irradiance_cache(std::shared_ptr<IrradianceCache> cache) {
+            m_irradiance_cache = std::move(cache);
+        }
+
+        const std::shared_ptr<IrradianceCache> &irradiance_cache() const {
+            return m_irradiance_cache;
+        }
+
+        // Counts rays and intersection tests into `stats`, see
+        // `RenderStats`. Null, the default, counts nothing.
+        void set_render_stats(std::shared_ptr<RenderStats> stats) {
+            m_stats = std::move(stats);
+        }
+
+        const std::shared_ptr<RenderStats> &render_stats() const {
+            return m_stats;
+        }
+
+        // True if anything blocks `ray`. Stops at the first hit found,
+        // without building a HitResult, so it is cheaper than a nearest
+        // hit search. Meant for shadow rays.
+        bool occluded(const Ray &ray) const;
+
+        // Packet version of `occluded`, nonzero in the blocked lanes.
+        Lanes<lane_int> occluded(const RayPacket &packet) const;
+
+        // Traces the active lanes of a coherent packet of rays. Their
+        // shadow rays toward the sun are traced as a packet as well.
+        Lanes<Color> trace_packet(const RayPacket &packet, int reflect) const;
+    };
+
+    /*
+    * A rectangle of pixels, from `x_begin, y_begin` up to but excluding
+    * `x_end, y_end`.
+    */
+    struct PixelRegion {
+        int x_begin, y_begin, x_end, y_end;
+
+        int width() const {
+            return x_end - x_begin;
+        }
+
+        int height() const {
+            return y_end - y_begin;
+        }
+
+        std::size_t size() const {
+            return static_cast<std::size_t>(width()) * static_cast<std::size_t>(height());
+        }
     };
 
     /*
@@ -183,25 +551,96 @@ namespace joytracer {
         Vec3 m_position;
         std::array<double, 3> m_orientation;
         Mat3x3 m_view_transform;
-        double m_focal_distance;
-        double m_plane_width, m_plane_height;
+        real m_focal_distance;
+        real m_plane_width, m_plane_height;
+        std::array<real, 2> m_pixel_offset = {0.0, 0.0};
+        bool m_ray_packets = true;
+        bool m_wavefront = false;
+        int m_reflections = 4;
+
+        Ray primary_ray(int width, int height, real x, real y) const;
+        // Renders the pixels of `tile` into `frame`, which holds those of
+        // `frame_region`. Pixels whose `mask` entry is 0 are skipped, a
+        // null `mask` renders them all.
+        void render_tile(const Scene &scene, int width, int height, const PixelRegion &tile,
+            const std::vector<uint8_t> *mask, const PixelRegion &frame_region, std::vector<Color> &frame) const;
+        void render_tiles(const Scene &scene, int width, int height, const PixelRegion &region,
+            ThreadPool &pool, int tile_size,
+            const std::vector<uint8_t> *mask, std::vector<Color> &frame) const;
     public:
         void set_position(const Vec3 &position) {
             m_position = position;
         }
 
+        const Vec3 &position() const {
+            return m_position;
+        }
+
         // Set orientation as `{pitch, yaw, roll}`
         void set_orientation(const std::array<double, 3> &orientation);
 
-        void set_focal_distance(double focal_distance) {
+        const std::array<double, 3> &orientation() const {
+            return m_orientation;
+        }
+
+        void set_focal_distance(real focal_distance) {
             m_focal_distance = focal_distance;
         }
 
-        void set_plane_size(double width, double height) {
+        void set_plane_size(real width, real height) {
             m_plane_width = width; m_plane_height = height;
         }
 
+        // Where rays cross their pixel, from `{0, 0}` (the default, top left
+        // corner) to `{1, 1}`. Passes at different offsets antialias.
+        void set_pixel_offset(const std::array<real, 2> &offset) {
+            m_pixel_offset = offset;
+        }
+
+        // Trace primary rays in packets of `packet_width` neighbouring
+        // pixels, on by default.
+        void set_ray_packets(bool ray_packets) {
+            m_ray_packets = ray_packets;
+        }
+
+        // Trace each tile breadth first with a `Wavefront` instead of one
+        // path at a time, off by default.
+        void set_wavefront(bool wavefront) {
+            m_wavefront = wavefront;
+        }
+
+        // Bounces traced after the primary hit, 4 by default. Fewer make
+        // quicker, flatter frames.
+        void set_reflections(int reflections) {
+            m_reflections = reflections;
+        }
+
+        int reflections() const {
+            return m_reflections;
+        }
+
         std::vector<Color> render_scene(const Scene &scene, int width, int height);
-        Color test_point(const Scene &scene, int width, int height, int x, int y);
+
+        // Renders `tile_size` square tiles in parallel on `pool`. This and
+        // the overloads below throw `std::invalid_argument` unless
+        // `tile_size` is positive.
+        std::vector<Color> render_scene(const Scene &scene, int width, int height,
+            ThreadPool &pool, int tile_size = 32);
+
+        // Renders only the pixels of `region`, averaging `sample_count`
+        // samples from `first_sample` on, jittered like the passes of a
+        // `ProgressiveRenderer`. Returns the region's pixels row by row.
+        // Averaging the results of several sample ranges, weighted by
+        // their sample counts, gives the result of the whole range.
+        std::vector<Color> render_scene(const Scene &scene, int width, int height,
+            const PixelRegion &region, int first_sample, int sample_count,
+            ThreadPool &pool, int tile_size = 32) const;
+
+        // Like the parallel `render_scene`, but only renders the pixels
+        // whose `mask` entry is set into `frame`, and leaves the others.
+        void render_pixels(const Scene &scene, int width, int height,
+            ThreadPool &pool, const std::vector<uint8_t> &mask, std::vector<Color> &frame,
+            int tile_size = 32);
+        Color test_point(const Scene &scene, int width, int height, int x, int y) const;
     };
 }
@@ -0,0 +1,39 @@
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "image_io.h"
+#include "partial_image.h"
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr <<
+            "Usage: joytracer_merge <output.ppm|pfm|png> <part.jpart>...\n"
+            "Assembles the partial images written by joytracer_headless --region\n"
+            "and --sample-range into one image, averaging the sample ranges of\n"
+            "each pixel by their sample counts.\n";
+        return 1;
+    }
+
+    try {
+        joytracer::PartialImageMerger merger;
+        uint64_t samples = 0;
+
+        for (int i = 2; i < argc; ++i) {
+            auto part = joytracer::read_partial_image(argv[i]);
+            samples += part.region.size() * part.sample_count;
+            merger.add(part);
+        }
+
+        auto frame = merger.merge();
+        joytracer::write_image(argv[1], frame, merger.width(), merger.height());
+        std::cout << "Merged " << argc - 2 << " parts into a " << merger.width() << "x" << merger.height()
+            << " image with " << static_cast<double>(samples) / frame.size()
+            << " samples per pixel on average, wrote " << argv[1] << ".\n";
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
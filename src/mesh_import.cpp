@@ -0,0 +1,526 @@
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include "mesh_import.h"
+
+namespace joytracer {
+    using namespace std::string_literals;
+
+    namespace {
+        // Bytes each parallel OBJ task parses at a time.
+        const std::size_t obj_chunk_size = 1 << 22;
+
+        bool is_space(char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        const char *skip_spaces(const char *p, const char *end) {
+            while (p < end && is_space(*p)) {
+                ++p;
+            }
+
+            return p;
+        }
+
+        /*
+        * What one chunk of OBJ lines holds. Negative face indices count
+        * back from the last vertex, which depends on the chunks before, so
+        * they are stored relative to the chunk and `relative` lists them.
+        */
+        struct ObjChunk {
+            std::vector<Vec3> vertices;
+            std::vector<int64_t> indices;
+            std::vector<std::size_t> relative;
+            std::string error;
+        };
+
+        void parse_obj_chunk(const char *p, const char *end, ObjChunk &chunk) {
+            std::vector<int64_t> polygon;
+            std::vector<uint8_t> polygon_relative;
+
+            while (p < end) {
+                p = skip_spaces(p, end);
+                auto line_end = static_cast<const char *>(std::memchr(p, '\n', end - p));
+                line_end = line_end ? line_end : end;
+
+                if (line_end - p > 1 && p[0] == 'v' && is_space(p[1])) {
+                    Vec3 vertex;
+                    ++p;
+
+                    for (auto &coordinate: vertex) {
+                        p = skip_spaces(p, line_end);
+                        p += p < line_end && *p == '+';
+                        double value;
+                        auto result = std::from_chars(p, line_end, value);
+
+                        if (result.ec != std::errc()) {
+                            chunk.error = "Malformed vertex";
+                            return;
+                        }
+
+                        coordinate = static_cast<real>(value);
+                        p = result.ptr;
+                    }
+
+                    chunk.vertices.push_back(vertex);
+                } else if (line_end - p > 1 && p[0] == 'f' && is_space(p[1])) {
+                    polygon.clear();
+                    polygon_relative.clear();
+                    p = skip_spaces(p + 1, line_end);
+
+                    while (p < line_end) {
+                        int64_t index;
+                        auto result = std::from_chars(p, line_end, index);
+
+                        if (result.ec != std::errc() || index == 0) {
+                            chunk.error = "Malformed face";
+                            return;
+                        }
+
+                        // Zero based, negative ones from the end of the chunk's
+                        // vertices so far.
+                        bool relative = index < 0;
+                        polygon.push_back(relative ?
+                            static_cast<int64_t>(chunk.vertices.size()) + index : index - 1);
+                        polygon_relative.push_back(relative);
+
+                        // Skip texture coordinate and normal indices.
+                        p = result.ptr;
+
+                        while (p < line_end && !is_space(*p)) {
+                            ++p;
+                        }
+
+                        p = skip_spaces(p, line_end);
+                    }
+
+                    if (polygon.size() < 3) {
+                        chunk.error = "Face with less than three vertices";
+                        return;
+                    }
+
+                    for (std::size_t i = 1; i + 1 < polygon.size(); ++i) {
+                        for (auto corner: {std::size_t(0), i, i + 1}) {
+                            if (polygon_relative[corner]) {
+                                chunk.relative.push_back(chunk.indices.size());
+                            }
+
+                            chunk.indices.push_back(polygon[corner]);
+                        }
+                    }
+                }
+
+                p = line_end + 1;
+            }
+        }
+
+        // Appends the chunks in file order.
+        void merge_obj_chunks(std::vector<ObjChunk> &chunks, MeshData &mesh, const std::string &filename) {
+            for (auto &chunk: chunks) {
+                if (!chunk.error.empty()) {
+                    throw std::runtime_error(chunk.error + " in "s + filename);
+                }
+
+                auto base = static_cast<int64_t>(mesh.vertices->size());
+                mesh.vertices->insert(mesh.vertices->end(), chunk.vertices.begin(), chunk.vertices.end());
+
+                for (auto i: chunk.relative) {
+                    chunk.indices[i] += base;
+                }
+
+                for (std::size_t i = 0; i < chunk.indices.size(); i += 3) {
+                    std::array<uint32_t, 3> face;
+
+                    for (std::size_t corner = 0; corner < 3; ++corner) {
+                        auto index = chunk.indices[i + corner];
+
+                        if (index < 0 || index > std::numeric_limits<uint32_t>::max()) {
+                            throw std::out_of_range("Face index out of range in "s + filename);
+                        }
+
+                        face[corner] = static_cast<uint32_t>(index);
+                    }
+
+                    mesh.faces.push_back(face);
+                }
+
+                chunk = ObjChunk();
+            }
+        }
+
+        enum class PlyType { int8, uint8, int16, uint16, int32, uint32, float32, float64 };
+
+        struct PlyProperty {
+            std::string name;
+            PlyType type;
+            bool list = false;
+            PlyType count_type = PlyType::uint8;
+        };
+
+        struct PlyElement {
+            std::string name;
+            uint64_t count;
+            std::vector<PlyProperty> properties;
+        };
+
+        PlyType ply_type(const std::string &name) {
+            static const std::pair<const char *, PlyType> types[] = {
+                {"char", PlyType::int8}, {"int8", PlyType::int8},
+                {"uchar", PlyType::uint8}, {"uint8", PlyType::uint8},
+                {"short", PlyType::int16}, {"int16", PlyType::int16},
+                {"ushort", PlyType::uint16}, {"uint16", PlyType::uint16},
+                {"int", PlyType::int32}, {"int32", PlyType::int32},
+                {"uint", PlyType::uint32}, {"uint32", PlyType::uint32},
+                {"float", PlyType::float32}, {"float32", PlyType::float32},
+                {"double", PlyType::float64}, {"float64", PlyType::float64},
+            };
+
+            for (const auto &[type_name, type]: types) {
+                if (name == type_name) {
+                    return type;
+                }
+            }
+
+            throw std::runtime_error("Unknown PLY type "s + name);
+        }
+
+        std::size_t ply_size(PlyType type) {
+            switch (type) {
+            case PlyType::int8: case PlyType::uint8: return 1;
+            case PlyType::int16: case PlyType::uint16: return 2;
+            case PlyType::int32: case PlyType::uint32: case PlyType::float32: return 4;
+            default: return 8;
+            }
+        }
+
+        // The fewest bytes a record of `element` takes, with empty lists.
+        uint64_t min_record_size(const PlyElement &element) {
+            uint64_t size = 0;
+
+            for (const auto &property: element.properties) {
+                size += ply_size(property.list ? property.count_type : property.type);
+            }
+
+            return size;
+        }
+
+        /*
+        * Reads a binary PLY body through a fixed buffer.
+        */
+        class PlyReader {
+        public:
+            PlyReader(std::ifstream &in, bool swap_bytes) :
+                m_in(in), m_swap_bytes(swap_bytes), m_buffer(1 << 16), m_begin(0), m_end(0) {}
+
+            double read(PlyType type) {
+                unsigned char bytes[8];
+                auto size = ply_size(type);
+                take(bytes, size);
+
+                if (m_swap_bytes) {
+                    std::reverse(bytes, bytes + size);
+                }
+
+                switch (type) {
+                case PlyType::int8: return as<int8_t>(bytes);
+                case PlyType::uint8: return as<uint8_t>(bytes);
+                case PlyType::int16: return as<int16_t>(bytes);
+                case PlyType::uint16: return as<uint16_t>(bytes);
+                case PlyType::int32: return as<int32_t>(bytes);
+                case PlyType::uint32: return as<uint32_t>(bytes);
+                case PlyType::float32: return as<float>(bytes);
+                default: return as<double>(bytes);
+                }
+            }
+
+            void skip(const PlyProperty &property) {
+                if (!property.list) {
+                    read(property.type);
+                    return;
+                }
+
+                auto count = static_cast<uint64_t>(read(property.count_type));
+
+                for (uint64_t i = 0; i < count; ++i) {
+                    read(property.type);
+                }
+            }
+        private:
+            std::ifstream &m_in;
+            bool m_swap_bytes;
+            std::vector<char> m_buffer;
+            std::size_t m_begin, m_end;
+
+            template<typename T>
+            static double as(const unsigned char *bytes) {
+                T value;
+                std::memcpy(&value, bytes, sizeof(T));
+                return static_cast<double>(value);
+            }
+
+            void take(unsigned char *out, std::size_t size) {
+                if (m_end - m_begin < size) {
+                    std::copy(m_buffer.begin() + m_begin, m_buffer.begin() + m_end, m_buffer.begin());
+                    m_end -= m_begin;
+                    m_begin = 0;
+                    m_in.read(m_buffer.data() + m_end, static_cast<std::streamsize>(m_buffer.size() - m_end));
+                    m_end += static_cast<std::size_t>(m_in.gcount());
+
+                    if (m_end < size) {
+                        throw std::runtime_error("Truncated PLY file");
+                    }
+                }
+
+                std::memcpy(out, m_buffer.data() + m_begin, size);
+                m_begin += size;
+            }
+        };
+
+        std::string lowercase_extension(const std::string &filename) {
+            auto dot = filename.find_last_of('.');
+            auto extension = dot == std::string::npos ? std::string() : filename.substr(dot + 1);
+            std::transform(extension.begin(), extension.end(), extension.begin(),
+                [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+            return extension;
+        }
+    }
+
+    MeshData load_obj(const std::string &filename, ThreadPool *pool) {
+        std::ifstream in(filename, std::ios::binary);
+
+        if (!in) {
+            throw std::runtime_error("Cannot open "s + filename);
+        }
+
+        MeshData mesh;
+        auto chunk_count = pool ? pool->size() : std::size_t(1);
+        std::vector<char> block;
+        std::vector<ObjChunk> chunks(chunk_count);
+
+        while (in) {
+            // Keep the partial last line of the previous block in front.
+            auto carry = block.size();
+            block.resize(carry + chunk_count * obj_chunk_size);
+            in.read(block.data() + carry, static_cast<std::streamsize>(chunk_count * obj_chunk_size));
+            block.resize(carry + static_cast<std::size_t>(in.gcount()));
+
+            const char *begin = block.data();
+            const char *end = begin + block.size();
+
+            if (in) {
+                while (end > begin && end[-1] != '\n') {
+                    --end;
+                }
+
+                if (end == begin) {
+                    throw std::runtime_error("Line too long in "s + filename);
+                }
+            }
+
+            // Split at line ends into one chunk per task.
+            std::vector<ThreadPool::Task> tasks;
+            const char *chunk_begin = begin;
+
+            for (std::size_t i = 0; i < chunk_count && chunk_begin < end; ++i) {
+                const char *chunk_end = i + 1 == chunk_count ? end :
+                    std::min(end, chunk_begin + std::max<std::ptrdiff_t>((end - begin) / chunk_count, 1));
+
+                while (chunk_end < end && chunk_end[-1] != '\n') {
+                    ++chunk_end;
+                }
+
+                tasks.push_back([chunk_begin, chunk_end, &chunk = chunks[i]]() {
+                    parse_obj_chunk(chunk_begin, chunk_end, chunk);
+                });
+                chunk_begin = chunk_end;
+            }
+
+            if (pool && tasks.size() > 1) {
+                pool->run(std::move(tasks));
+            } else {
+                for (auto &task: tasks) {
+                    task();
+                }
+            }
+
+            merge_obj_chunks(chunks, mesh, filename);
+            block.erase(block.begin(), block.begin() + (end - begin));
+        }
+
+        return mesh;
+    }
+
+    MeshData load_ply(const std::string &filename) {
+        std::ifstream in(filename, std::ios::binary);
+        std::string line;
+
+        if (!in || !std::getline(in, line) || line.rfind("ply", 0) != 0) {
+            throw std::runtime_error(filename + " is not a PLY file"s);
+        }
+
+        std::vector<PlyElement> elements;
+        bool big_endian = false;
+
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+
+            std::istringstream words(line);
+            std::string keyword;
+            words >> keyword;
+
+            if (keyword == "end_header") {
+                break;
+            } else if (keyword == "format") {
+                std::string format;
+                words >> format;
+
+                if (format != "binary_little_endian" && format != "binary_big_endian") {
+                    throw std::runtime_error("Unsupported PLY format "s + format + " in " + filename);
+                }
+
+                big_endian = format == "binary_big_endian";
+            } else if (keyword == "element") {
+                PlyElement element;
+                words >> element.name >> element.count;
+                elements.push_back(element);
+            } else if (keyword == "property") {
+                if (elements.empty()) {
+                    throw std::runtime_error("PLY property outside of an element in "s + filename);
+                }
+
+                PlyProperty property;
+                std::string type;
+                words >> type;
+
+                if (type == "list") {
+                    std::string count_type;
+                    words >> count_type >> type;
+                    property.list = true;
+                    property.count_type = ply_type(count_type);
+                }
+
+                property.type = ply_type(type);
+                words >> property.name;
+                elements.back().properties.push_back(property);
+            }
+        }
+
+        if (!in) {
+            throw std::runtime_error("Truncated PLY header in "s + filename);
+        }
+
+        const uint16_t one = 1;
+        bool host_big_endian = *reinterpret_cast<const uint8_t *>(&one) == 0;
+        PlyReader reader(in, big_endian != host_big_endian);
+        MeshData mesh;
+
+        // Element counts come from the header, so reservations are capped
+        // by the records the rest of the file can hold.
+        auto data_begin = in.tellg();
+        in.seekg(0, std::ios::end);
+        auto data_size = static_cast<uint64_t>(in.tellg() - data_begin);
+        in.seekg(data_begin);
+        auto reservation = [&](const PlyElement &element) {
+            return static_cast<std::size_t>(
+                std::min(element.count, data_size / std::max(min_record_size(element), uint64_t(1))));
+        };
+        std::vector<double> polygon;
+
+        for (const auto &element: elements) {
+            if (element.name == "vertex") {
+                // The coordinate of each property, or -1 for other ones.
+                std::vector<int> axes;
+
+                for (const auto &property: element.properties) {
+                    auto axis = std::string("xyz").find(property.name);
+                    axes.push_back(property.name.size() == 1 && axis != std::string::npos && !property.list ?
+                        static_cast<int>(axis) : -1);
+                }
+
+                mesh.vertices->reserve(reservation(element));
+
+                for (uint64_t i = 0; i < element.count; ++i) {
+                    Vec3 vertex{0, 0, 0};
+
+                    for (std::size_t j = 0; j < axes.size(); ++j) {
+                        if (axes[j] < 0) {
+                            reader.skip(element.properties[j]);
+                        } else {
+                            vertex[axes[j]] = static_cast<real>(reader.read(element.properties[j].type));
+                        }
+                    }
+
+                    mesh.vertices->push_back(vertex);
+                }
+            } else if (element.name == "face") {
+                std::vector<uint8_t> is_index_list;
+
+                for (const auto &property: element.properties) {
+                    is_index_list.push_back(property.list &&
+                        (property.name == "vertex_indices" || property.name == "vertex_index"));
+                }
+
+                mesh.faces.reserve(reservation(element));
+
+                for (uint64_t i = 0; i < element.count; ++i) {
+                    for (std::size_t j = 0; j < is_index_list.size(); ++j) {
+                        const auto &property = element.properties[j];
+
+                        if (!is_index_list[j]) {
+                            reader.skip(property);
+                            continue;
+                        }
+
+                        polygon.resize(static_cast<std::size_t>(reader.read(property.count_type)));
+
+                        for (auto &index: polygon) {
+                            index = reader.read(property.type);
+
+                            if (index < 0 || index > std::numeric_limits<uint32_t>::max()) {
+                                throw std::out_of_range("Face index out of range in "s + filename);
+                            }
+                        }
+
+                        for (std::size_t corner = 1; corner + 1 < polygon.size(); ++corner) {
+                            mesh.faces.push_back({
+                                static_cast<uint32_t>(polygon[0]),
+                                static_cast<uint32_t>(polygon[corner]),
+                                static_cast<uint32_t>(polygon[corner + 1])
+                            });
+                        }
+                    }
+                }
+            } else {
+                for (uint64_t i = 0; i < element.count; ++i) {
+                    for (const auto &property: element.properties) {
+                        reader.skip(property);
+                    }
+                }
+            }
+        }
+
+        return mesh;
+    }
+
+    MeshData load_mesh_file(const std::string &filename, ThreadPool *pool) {
+        auto extension = lowercase_extension(filename);
+
+        if (extension == "obj") {
+            return load_obj(filename, pool);
+        }
+
+        if (extension == "ply") {
+            return load_ply(filename);
+        }
+
+        throw std::runtime_error("Unknown mesh file type "s + filename);
+    }
+} // namespace joytracer
@@ -0,0 +1,31 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "joymath.h"
+#include "thread_pool.h"
+
+namespace joytracer {
+    /*
+    * The vertices and triangles of a mesh file, ready for `TriangleMesh`.
+    */
+    struct MeshData {
+        std::shared_ptr<std::vector<Vec3>> vertices = std::make_shared<std::vector<Vec3>>();
+        std::vector<std::array<uint32_t, 3>> faces;
+    };
+
+    // Reads the vertex positions and faces of a Wavefront OBJ file, and
+    // splits polygons into triangle fans. The file is read in blocks of a
+    // few megabytes, whose lines are parsed in parallel on `pool` if given.
+    MeshData load_obj(const std::string &filename, ThreadPool *pool = nullptr);
+
+    // Reads the `vertex` and `face` elements of a binary PLY file, in
+    // either byte order, through a small read buffer.
+    MeshData load_ply(const std::string &filename);
+
+    // `load_obj` or `load_ply`, by file extension.
+    MeshData load_mesh_file(const std::string &filename, ThreadPool *pool = nullptr);
+}
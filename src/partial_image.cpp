@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include "image_io.h"
+#include "partial_image.h"
+
+namespace joytracer {
+    using namespace std::string_literals;
+
+    namespace {
+        constexpr char magic[] = "JOYPART";
+        constexpr int version = 1;
+    }
+
+    void write_partial_image(const std::string &filename, const PartialImage &image) {
+        std::ofstream out(filename, std::ios::binary);
+
+        if (!out) {
+            throw std::runtime_error("Cannot open "s + filename + " for writing");
+        }
+
+        const auto &region = image.region;
+        out << magic << ' ' << version << '\n'
+            << image.width << ' ' << image.height << '\n'
+            << region.x_begin << ' ' << region.y_begin << ' ' << region.x_end << ' ' << region.y_end << '\n'
+            << image.first_sample << ' ' << image.sample_count << '\n';
+
+        std::vector<float> row(region.width() * 3);
+
+        for (int y = 0; y < region.height(); ++y) {
+            for (int x = 0; x < region.width(); ++x) {
+                auto rgb = image.pixels[y * region.width() + x].to_rgb();
+                std::copy(rgb.begin(), rgb.end(), row.begin() + x * 3);
+            }
+
+            swap_to_little_endian(row);
+            out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+        }
+
+        if (!out) {
+            throw std::runtime_error("Failed writing "s + filename);
+        }
+    }
+
+    PartialImage read_partial_image(const std::string &filename) {
+        std::ifstream in(filename, std::ios::binary);
+
+        if (!in) {
+            throw std::runtime_error("Cannot open "s + filename);
+        }
+
+        std::string file_magic;
+        int file_version = 0;
+        PartialImage image;
+        auto &region = image.region;
+        in >> file_magic >> file_version
+            >> image.width >> image.height
+            >> region.x_begin >> region.y_begin >> region.x_end >> region.y_end
+            >> image.first_sample >> image.sample_count;
+
+        if (!in || file_magic != magic) {
+            throw std::runtime_error(filename + " is not a partial image");
+        }
+
+        if (file_version != version) {
+            throw std::runtime_error(filename + " has unsupported version "s + std::to_string(file_version));
+        }
+
+        if (image.width <= 0 || image.height <= 0 || region.x_begin < 0 || region.y_begin < 0 ||
+            region.x_end > image.width || region.y_end > image.height ||
+            region.width() <= 0 || region.height() <= 0 || image.sample_count <= 0) {
+            throw std::runtime_error(filename + " has an invalid header");
+        }
+
+        // The single whitespace character ending the header.
+        in.get();
+        std::vector<float> data(region.size() * 3);
+        in.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float));
+
+        if (!in) {
+            throw std::runtime_error(filename + " is truncated");
+        }
+
+        swap_to_little_endian(data);
+        image.pixels.reserve(region.size());
+
+        for (std::size_t i = 0; i < data.size(); i += 3) {
+            image.pixels.push_back(Color::from_rgb({data[i], data[i + 1], data[i + 2]}));
+        }
+
+        return image;
+    }
+
+    void PartialImageMerger::add(const PartialImage &image) {
+        if (m_sums.empty()) {
+            m_width = image.width;
+            m_height = image.height;
+            m_sums.assign(static_cast<std::size_t>(m_width) * m_height, {0, 0, 0});
+            m_samples.assign(m_sums.size(), 0);
+        } else if (image.width != m_width || image.height != m_height) {
+            throw std::runtime_error("Partial images of different sizes: "s +
+                std::to_string(image.width) + "x" + std::to_string(image.height) + " and " +
+                std::to_string(m_width) + "x" + std::to_string(m_height));
+        }
+
+        const auto &region = image.region;
+
+        for (int y = region.y_begin; y < region.y_end; ++y) {
+            for (int x = region.x_begin; x < region.x_end; ++x) {
+                auto rgb = image.pixels[(y - region.y_begin) * region.width() + x - region.x_begin].to_rgb();
+                auto &sum = m_sums[y * m_width + x];
+
+                for (std::size_t c = 0; c < 3; ++c) {
+                    sum[c] += static_cast<double>(rgb[c]) * image.sample_count;
+                }
+
+                m_samples[y * m_width + x] += image.sample_count;
+            }
+        }
+    }
+
+    std::vector<Color> PartialImageMerger::merge() const {
+        auto missing = std::count(m_samples.begin(), m_samples.end(), 0);
+
+        if (m_sums.empty() || missing > 0) {
+            throw std::runtime_error("The partial images leave "s +
+                (m_sums.empty() ? "the whole image"s : std::to_string(missing) + " pixels") + " uncovered");
+        }
+
+        std::vector<Color> frame;
+        frame.reserve(m_sums.size());
+
+        for (std::size_t i = 0; i < m_sums.size(); ++i) {
+            auto samples = static_cast<double>(m_samples[i]);
+            frame.push_back(Color::from_rgb({
+                static_cast<real>(m_sums[i][0] / samples),
+                static_cast<real>(m_sums[i][1] / samples),
+                static_cast<real>(m_sums[i][2] / samples)}));
+        }
+
+        return frame;
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "joymath.h"
+#include "joytracer.h"
+
+namespace joytracer {
+    /*
+    * Part of a render: the mean of samples `first_sample` up to
+    * `first_sample + sample_count` of the pixels in `region`, out of a
+    * `width` by `height` image. Separate processes render the parts of an
+    * image and `PartialImageMerger` puts them together.
+    */
+    struct PartialImage {
+        int width = 0, height = 0;
+        PixelRegion region{};
+        int first_sample = 0, sample_count = 0;
+        // The pixels of `region`, row by row.
+        std::vector<Color> pixels;
+    };
+
+    // Writes a text header like that of PFM, then the pixels as little
+    // endian floats on any host, top row first.
+    void write_partial_image(const std::string &filename, const PartialImage &image);
+
+    // Throws `std::runtime_error` on a malformed file.
+    PartialImage read_partial_image(const std::string &filename);
+
+    /*
+    * Assembles partial images of the same size. Pixels covered by several
+    * parts, rendered with different sample ranges, get the mean of the
+    * parts weighted by their sample counts, which is what rendering all
+    * the samples at once would have given.
+    */
+    class PartialImageMerger {
+    public:
+        // Throws `std::runtime_error` if `image` doesn't fit the parts
+        // added before.
+        void add(const PartialImage &image);
+
+        // Throws `std::runtime_error` if a pixel isn't covered by any part.
+        std::vector<Color> merge() const;
+
+        int width() const {
+            return m_width;
+        }
+
+        int height() const {
+            return m_height;
+        }
+    private:
+        int m_width = 0, m_height = 0;
+        std::vector<std::array<double, 3>> m_sums;
+        std::vector<uint64_t> m_samples;
+    };
+}
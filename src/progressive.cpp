@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+
+#include "hammersley.h"
+#include "progressive.h"
+
+namespace joytracer {
+    ProgressiveRenderer::ProgressiveRenderer(int width, int height, int preview_scale) :
+        m_width(width), m_height(height),
+        m_preview_scale(std::max(preview_scale, 1)),
+        m_max_error(0), m_min_samples(1),
+        m_pass(width * height),
+        m_frame(width * height),
+        m_motion_milliseconds(33), m_motion_reflections(1),
+        m_motion_scale(m_preview_scale) {
+        reset();
+    }
+
+    void ProgressiveRenderer::set_motion_target(double milliseconds, int reflections) {
+        m_motion_milliseconds = milliseconds;
+        m_motion_reflections = std::max(reflections, 0);
+    }
+
+    void ProgressiveRenderer::set_adaptive(real max_error, int min_samples) {
+        m_max_error = max_error;
+        m_min_samples = std::max(min_samples, 1);
+    }
+
+    void ProgressiveRenderer::reset() {
+        m_sample_count = 0;
+        m_preview_done = m_preview_scale == 1;
+        m_active_pixels = m_width * m_height;
+        m_samples.assign(m_width * m_height, ColorStatistics());
+        m_active.assign(m_width * m_height, 1);
+        std::fill(m_frame.begin(), m_frame.end(), Color::black());
+    }
+
+    void ProgressiveRenderer::render_scaled(const Scene &scene, Camera &camera, ThreadPool &pool, double scale) {
+        int width = std::max(static_cast<int>(std::ceil(m_width / scale)), 1);
+        int height = std::max(static_cast<int>(std::ceil(m_height / scale)), 1);
+        auto scaled = camera.render_scene(scene, width, height, pool);
+
+        for (int y = 0; y < m_height; ++y) {
+            const auto *row = &scaled[(y * height / m_height) * width];
+
+            for (int x = 0; x < m_width; ++x) {
+                m_frame[y * m_width + x] = row[x * width / m_width];
+            }
+        }
+    }
+
+    const std::vector<Color> &ProgressiveRenderer::render_motion_frame(
+        const Scene &scene, Camera &camera, ThreadPool &pool) {
+        RenderStats::ScopedPhase phase(scene.render_stats().get(), "motion");
+        auto start = std::chrono::steady_clock::now();
+        auto reflections = camera.reflections();
+        camera.set_reflections(std::min(reflections, m_motion_reflections));
+        reset();
+        render_scaled(scene, camera, pool, m_motion_scale);
+        m_preview_done = true;
+        camera.set_reflections(reflections);
+
+        // The time grows with the pixel count, so with the square of the
+        // resolution. Change it by at most half at a time to ride out
+        // frames that happen to be quick or slow.
+        auto milliseconds = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        auto change = std::sqrt(std::max(milliseconds, 0.01) / m_motion_milliseconds);
+        m_motion_scale = std::clamp(m_motion_scale * std::clamp(change, 0.5, 1.5), 1.0, 16.0);
+        return m_frame;
+    }
+
+    const std::vector<Color> &ProgressiveRenderer::render_pass(
+        const Scene &scene, Camera &camera, ThreadPool &pool) {
+        if (!m_preview_done) {
+            RenderStats::ScopedPhase phase(scene.render_stats().get(), "preview");
+            render_scaled(scene, camera, pool, m_preview_scale);
+            m_preview_done = true;
+            return m_frame;
+        }
+
+        if (converged()) {
+            return m_frame;
+        }
+
+        {
+            RenderStats::ScopedPhase phase(scene.render_stats().get(), "trace");
+            auto offset = hammersley::halton2d(m_sample_count);
+            camera.set_pixel_offset({static_cast<real>(offset[0]), static_cast<real>(offset[1])});
+            camera.render_pixels(scene, m_width, m_height, pool, m_active, m_pass);
+            camera.set_pixel_offset({0, 0});
+        }
+
+        RenderStats::ScopedPhase phase(scene.render_stats().get(), "accumulate");
+        ++m_sample_count;
+        m_active_pixels = 0;
+
+        for (std::size_t i = 0; i < m_pass.size(); ++i) {
+            if (!m_active[i]) {
+                continue;
+            }
+
+            auto &samples = m_samples[i];
+            samples.add(m_pass[i]);
+            m_frame[i] = samples.average();
+            m_active[i] = m_max_error <= 0 ||
+                samples.count() < static_cast<std::size_t>(m_min_samples) ||
+                samples.standard_error() > m_max_error;
+            m_active_pixels += m_active[i];
+        }
+
+        return m_frame;
+    }
+
+    std::size_t ProgressiveRenderer::total_samples() const {
+        return std::accumulate(m_samples.begin(), m_samples.end(), std::size_t(0),
+            [](std::size_t total, const auto &samples) { return total + samples.count(); });
+    }
+
+    std::vector<Color> ProgressiveRenderer::sample_map() const {
+        std::vector<Color> map(m_samples.size());
+        auto scale = real(1) / std::max(m_sample_count, 1);
+
+        std::transform(m_samples.begin(), m_samples.end(), map.begin(), [=](const auto &samples) {
+            auto level = samples.count() * scale;
+            return Color::from_rgb({level, level, level});
+        });
+
+        return map;
+    }
+} // namespace joytracer
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "joymath.h"
+#include "joytracer.h"
+#include "thread_pool.h"
+
+namespace joytracer {
+    /*
+    * Refines a frame one pass at a time, so a viewer has something to show
+    * right away and a better image after every pass.
+    *
+    * The first pass is a preview at `1 / preview_scale` of the resolution,
+    * blown up to full size. Every later pass traces one more sample per
+    * pixel, jittered inside the pixel along a Halton sequence, and adds it
+    * to a running average. The first of these samples the pixel corner,
+    * just like `Camera::render_scene`.
+    *
+    * With adaptive sampling on, a pixel stops getting samples once the
+    * standard error of its average drops below a threshold, so flat areas
+    * like the sky settle after a few passes and the noisy ones get the rest.
+    *
+    * While the camera moves, motion frames replace the passes. They render
+    * at a reduced resolution and bounce depth, scaled so each takes about
+    * a target time, and the next pass after one starts refining over.
+    */
+    class ProgressiveRenderer {
+    private:
+        int m_width, m_height;
+        int m_preview_scale;
+        int m_sample_count;
+        bool m_preview_done;
+        real m_max_error;
+        int m_min_samples;
+        std::size_t m_active_pixels;
+        std::vector<ColorStatistics> m_samples;
+        std::vector<uint8_t> m_active;
+        std::vector<Color> m_pass;
+        std::vector<Color> m_frame;
+        double m_motion_milliseconds;
+        int m_motion_reflections;
+        // Window pixels per rendered pixel along each axis, at least 1.
+        double m_motion_scale;
+
+        // Renders at `1 / scale` of the resolution into `m_frame`.
+        void render_scaled(const Scene &scene, Camera &camera, ThreadPool &pool, double scale);
+    public:
+        // A `preview_scale` of 1 skips the preview.
+        ProgressiveRenderer(int width, int height, int preview_scale = 4);
+
+        // Once a pixel has `min_samples`, only sample it again while the
+        // standard error of its color is above `max_error`. A `max_error`
+        // of 0, the default, samples every pixel in every pass.
+        void set_adaptive(real max_error, int min_samples = 4);
+
+        // Renders the next pass and returns the frame so far.
+        const std::vector<Color> &render_pass(const Scene &scene, Camera &camera, ThreadPool &pool);
+
+        // Starts over, for example after the camera moved.
+        void reset();
+
+        // Motion frames aim to take `milliseconds` and trace at most
+        // `reflections` bounces, 33 ms and 1 by default.
+        void set_motion_target(double milliseconds, int reflections = 1);
+
+        // Renders a frame for a moving camera, returns it blown up to full
+        // size and adjusts `motion_scale()` to the time it took. The next
+        // `render_pass` starts over after it, with no preview.
+        const std::vector<Color> &render_motion_frame(const Scene &scene, Camera &camera, ThreadPool &pool);
+
+        double motion_scale() const {
+            return m_motion_scale;
+        }
+
+        const std::vector<Color> &frame() const {
+            return m_frame;
+        }
+
+        // Passes done after the preview, which is also the most samples
+        // any pixel has.
+        int sample_count() const {
+            return m_sample_count;
+        }
+
+        // Pixels the next pass will sample.
+        std::size_t active_pixel_count() const {
+            return m_active_pixels;
+        }
+
+        // True once adaptive sampling has stopped on every pixel.
+        bool converged() const {
+            return m_active_pixels == 0;
+        }
+
+        // Samples traced over all pixels.
+        std::size_t total_samples() const;
+
+        // Debug view of how many samples each pixel got, from black for
+        // none to white for `sample_count()`.
+        std::vector<Color> sample_map() const;
+    };
+}
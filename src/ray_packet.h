@@ -0,0 +1,109 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#include "joymath.h"
+
+#ifndef JOYTRACER_PACKET_WIDTH
+#define JOYTRACER_PACKET_WIDTH 4
+#endif
+
+// Short lane loops get fully unrolled before GCC's vectorizer sees them,
+// so ask for vector code explicitly. Needs `-fopenmp-simd`, which does not
+// pull in the OpenMP runtime.
+#if defined(__GNUC__)
+#define JOYTRACER_LANE_LOOP _Pragma("omp simd")
+#else
+#define JOYTRACER_LANE_LOOP
+#endif
+
+namespace joytracer {
+    /*
+    * Number of rays traced together. Four doubles or eight floats fill an
+    * AVX register, twice as many an AVX-512 one.
+    */
+    constexpr std::size_t packet_width = JOYTRACER_PACKET_WIDTH;
+
+    /*
+    * Integer as wide as `real`, for lane flags and ids that share loops
+    * with it.
+    */
+    using lane_int = std::conditional_t<sizeof(real) == 4, int32_t, int64_t>;
+
+    /*
+    * One value per ray of a packet.
+    *
+    * Packet kernels loop over lanes without branching, and rely on the
+    * compiler to turn each `JOYTRACER_LANE_LOOP` into vector instructions,
+    * just like the rest of the math in this project (see
+    * docs/vectorization.md).
+    */
+    template<class T>
+    using Lanes = std::array<T, packet_width>;
+
+    /*
+    * A bundle of rays in structure of arrays layout. Inactive lanes are
+    * carried along but never report hits.
+    *
+    * Lane flags are `lane_int` rather than bools: mixing them with reals
+    * of the same width in one loop is what lets GCC and clang vectorize
+    * the kernels.
+    */
+    struct alignas(64) RayPacket {
+        std::array<Lanes<real>, 3> origin;
+        std::array<Lanes<real>, 3> direction;
+        std::array<Lanes<real>, 3> inverse_direction;
+        Lanes<lane_int> active;
+
+        // Loads `origins` and `directions` (expected normalized) in the
+        // lanes whose `active` flag is set.
+        static RayPacket from_rays(
+            const Lanes<Vec3> &origins,
+            const Lanes<Vec3> &directions,
+            const Lanes<bool> &active) {
+            RayPacket packet;
+
+            for (std::size_t axis = 0; axis < 3; ++axis) {
+                for (std::size_t i = 0; i < packet_width; ++i) {
+                    real d = active[i] ? directions[i][axis] : real(1);
+                    packet.origin[axis][i] = active[i] ? origins[i][axis] : real(0);
+                    packet.direction[axis][i] = d;
+                    // -ffast-math assumes finite values, so keep them finite.
+                    const real min_direction = Precision<real>::min_direction;
+                    packet.inverse_direction[axis][i] =
+                        1 / (std::fabs(d) < min_direction ? std::copysign(min_direction, d) : d);
+                }
+            }
+
+            std::copy(active.begin(), active.end(), packet.active.begin());
+            return packet;
+        }
+    };
+
+    /*
+    * The nearest hits found so far for a packet. `primitive` is an id
+    * chosen by whoever runs the kernels, `no_hit` until a lane hits.
+    */
+    struct alignas(64) PacketHits {
+        static constexpr lane_int no_hit = -1;
+
+        Lanes<real> distance;
+        Lanes<lane_int> primitive;
+
+        PacketHits() {
+            distance.fill(std::numeric_limits<real>::max());
+            primitive.fill(no_hit);
+        }
+
+        // Records a hit at `t` in `lane`, if `hit` is set and `t` is
+        // closer than the current one. Meant for the kernel loops, so it
+        // selects rather than branches.
+        void record(std::size_t lane, bool hit, real t, lane_int id) {
+            bool closer = hit & (t < distance[lane]);
+            distance[lane] = closer ? t : distance[lane];
+            primitive[lane] = closer ? id : primitive[lane];
+        }
+    };
+}
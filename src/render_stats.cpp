@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+
+#include "render_stats.h"
+
+namespace joytracer {
+    namespace {
+        const char *surface_type_names[RenderCounters::surface_type_count] = {
+            "triangle", "floor", "sphere", "mesh", "instance"
+        };
+
+        std::atomic<uint64_t> next_stats_id{1};
+
+        // The high-water mark of this process's own resident memory, 0
+        // where /proc is missing. Unlike getrusage, it does not start at
+        // the size of the parent that forked us.
+        uint64_t peak_resident_bytes() {
+            std::ifstream status("/proc/self/status");
+            std::string line;
+
+            while (std::getline(status, line)) {
+                if (line.rfind("VmHWM:", 0) == 0) {
+                    return std::stoull(line.substr(6)) * 1024;
+                }
+            }
+
+            return 0;
+        }
+
+        template<typename T, std::size_t N>
+        void write_array(std::ostream &out, const std::array<T, N> &values) {
+            out << '[';
+
+            for (std::size_t i = 0; i < N; ++i) {
+                out << (i ? ", " : "") << values[i];
+            }
+
+            out << ']';
+        }
+
+        void write_by_type(std::ostream &out, const std::array<uint64_t, RenderCounters::surface_type_count> &values) {
+            out << '{';
+
+            for (std::size_t i = 0; i < values.size(); ++i) {
+                out << (i ? ", " : "") << '"' << surface_type_names[i] << "\": " << values[i];
+            }
+
+            out << '}';
+        }
+    }
+
+    void RenderCounters::add(const RenderCounters &other) {
+        std::transform(rays.begin(), rays.end(), other.rays.begin(), rays.begin(), std::plus<>());
+        shadow_rays += other.shadow_rays;
+        std::transform(tests.begin(), tests.end(), other.tests.begin(), tests.begin(), std::plus<>());
+        std::transform(hits.begin(), hits.end(), other.hits.begin(), hits.begin(), std::plus<>());
+    }
+
+    RenderStats::RenderStats() : m_id(next_stats_id++) {}
+
+    RenderCounters &RenderStats::register_thread() {
+        std::scoped_lock lock(m_mutex);
+        auto id = std::this_thread::get_id();
+        auto existing = std::find_if(m_threads.begin(), m_threads.end(),
+            [&](const auto &thread) { return thread.first == id; });
+
+        if (existing != m_threads.end()) {
+            return *existing->second;
+        }
+
+        m_threads.emplace_back(id, std::make_unique<RenderCounters>());
+        return *m_threads.back().second;
+    }
+
+    RenderCounters RenderStats::total() const {
+        std::scoped_lock lock(m_mutex);
+        RenderCounters total;
+
+        for (const auto &thread: m_threads) {
+            total.add(*thread.second);
+        }
+
+        return total;
+    }
+
+    void RenderStats::add_phase(const std::string &name, double milliseconds) {
+        std::scoped_lock lock(m_mutex);
+        auto phase = std::find_if(m_phases.begin(), m_phases.end(),
+            [&](const auto &p) { return p.name == name; });
+
+        if (phase == m_phases.end()) {
+            m_phases.push_back({name, milliseconds, 1});
+        } else {
+            phase->milliseconds += milliseconds;
+            ++phase->count;
+        }
+    }
+
+    void RenderStats::reset() {
+        std::scoped_lock lock(m_mutex);
+
+        for (auto &thread: m_threads) {
+            *thread.second = RenderCounters();
+        }
+
+        m_phases.clear();
+    }
+
+    std::string RenderStats::to_json() const {
+        auto counters = total();
+        std::ostringstream out;
+        auto primary_rays = counters.rays[0];
+        auto secondary_rays = std::accumulate(counters.rays.begin() + 1, counters.rays.end(), uint64_t(0));
+
+        out << "{\n";
+        out << "  \"rays\": {\"primary\": " << primary_rays
+            << ", \"secondary\": " << secondary_rays
+            << ", \"shadow\": " << counters.shadow_rays << "},\n";
+        out << "  \"rays_by_depth\": ";
+        write_array(out, counters.rays);
+        out << ",\n  \"intersection_tests\": ";
+        write_by_type(out, counters.tests);
+        out << ",\n  \"intersection_hits\": ";
+        write_by_type(out, counters.hits);
+        out << ",\n  \"phases\": [";
+
+        std::scoped_lock lock(m_mutex);
+
+        for (std::size_t i = 0; i < m_phases.size(); ++i) {
+            const auto &phase = m_phases[i];
+            out << (i ? "," : "") << "\n    {\"name\": \"" << phase.name
+                << "\", \"milliseconds\": " << phase.milliseconds
+                << ", \"count\": " << phase.count << '}';
+        }
+
+        out << (m_phases.empty() ? "" : "\n  ") << "],\n";
+        out << "  \"threads\": " << m_threads.size();
+
+        if (auto peak = peak_resident_bytes()) {
+            out << ",\n  \"peak_resident_bytes\": " << peak;
+        }
+
+        out << "\n}\n";
+        return out.str();
+    }
+} // namespace joytracer
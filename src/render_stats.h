@@ -0,0 +1,147 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace joytracer {
+    /*
+    * Hot path counters of one thread, on cache lines of their own so that
+    * threads counting side by side never share one.
+    */
+    struct alignas(64) RenderCounters {
+        // The `Surface` alternatives, in order.
+        static constexpr std::size_t surface_type_count = 5;
+        // Deeper rays count in the last bucket.
+        static constexpr std::size_t max_depth = 16;
+
+        // Rays traced at each depth, primary rays at 0.
+        std::array<uint64_t, max_depth> rays{};
+        uint64_t shadow_rays = 0;
+        // Intersection tests and hits by surface type. A hit is a test
+        // that found the nearest surface so far, or for a shadow ray the
+        // one that blocks it, so hits farther than one already found do
+        // not count. A packet kernel counts once per active lane. Tests
+        // inside a prototype are not broken down: they count as one test
+        // of its instance.
+        std::array<uint64_t, surface_type_count> tests{};
+        std::array<uint64_t, surface_type_count> hits{};
+
+        // Depth of the `trace_ray` call running on this thread.
+        std::size_t depth = 0;
+
+        void add(const RenderCounters &other);
+    };
+
+    /*
+    * Counts rays at the current depth of a thread, and makes the rays
+    * traced in its lifetime one level deeper. Does nothing without
+    * counters.
+    */
+    class RayDepthScope {
+    public:
+        explicit RayDepthScope(RenderCounters *counters, uint64_t rays = 1) : m_counters(counters) {
+            if (m_counters) {
+                m_counters->rays[std::min(m_counters->depth, RenderCounters::max_depth - 1)] += rays;
+                ++m_counters->depth;
+            }
+        }
+
+        ~RayDepthScope() {
+            if (m_counters) {
+                --m_counters->depth;
+            }
+        }
+
+        RayDepthScope(const RayDepthScope&) = delete;
+        RayDepthScope& operator=(const RayDepthScope&) = delete;
+    private:
+        RenderCounters *m_counters;
+    };
+
+    /*
+    * Optional render statistics: ray and intersection counts, and the
+    * time spent in each phase of a render, reported as JSON.
+    *
+    * Each thread counts into its own `RenderCounters`, found through a
+    * thread local cache, so counting never takes a lock. `total()` sums
+    * them and must not run while a render is counting.
+    */
+    class RenderStats {
+    public:
+        RenderStats();
+
+        RenderStats(const RenderStats&) = delete;
+        RenderStats& operator=(const RenderStats&) = delete;
+
+        // The counters of the calling thread.
+        RenderCounters &local() {
+            thread_local uint64_t owner = 0;
+            thread_local RenderCounters *counters = nullptr;
+
+            if (owner != m_id) {
+                counters = &register_thread();
+                owner = m_id;
+            }
+
+            return *counters;
+        }
+
+        RenderCounters total() const;
+
+        // Adds `milliseconds` to the phase `name`, which is created on
+        // first use and reported in that order.
+        void add_phase(const std::string &name, double milliseconds);
+
+        // Zeroes the counters and drops the phases.
+        void reset();
+
+        std::string to_json() const;
+
+        /*
+        * Adds the time from its construction to its destruction to a
+        * phase.
+        */
+        class ScopedPhase {
+        public:
+            ScopedPhase(RenderStats *stats, std::string name) :
+                m_stats(stats), m_name(std::move(name)),
+                m_start(std::chrono::steady_clock::now()) {}
+
+            ~ScopedPhase() {
+                if (m_stats) {
+                    m_stats->add_phase(m_name, std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - m_start).count());
+                }
+            }
+
+            ScopedPhase(const ScopedPhase&) = delete;
+            ScopedPhase& operator=(const ScopedPhase&) = delete;
+        private:
+            RenderStats *m_stats;
+            std::string m_name;
+            std::chrono::steady_clock::time_point m_start;
+        };
+    private:
+        struct Phase {
+            std::string name;
+            double milliseconds;
+            uint64_t count;
+        };
+
+        // Never 0, which the thread local cache starts at.
+        uint64_t m_id;
+        mutable std::mutex m_mutex;
+        std::vector<std::pair<std::thread::id, std::unique_ptr<RenderCounters>>> m_threads;
+        std::vector<Phase> m_phases;
+
+        RenderCounters &register_thread();
+    };
+}
@@ -0,0 +1,122 @@
+#include <utility>
+
+#include "render_thread.h"
+
+namespace joytracer {
+    RenderThread::RenderThread(Scene &scene, ThreadPool &pool, ProgressiveRenderer &progressive,
+        const Camera &camera, int max_samples, FrameCallback on_frame) :
+        m_scene(scene), m_pool(pool), m_progressive(progressive),
+        m_max_samples(max_samples), m_on_frame(std::move(on_frame)),
+        m_camera(camera),
+        m_thread([this, camera]() { loop(camera); }) {}
+
+    RenderThread::~RenderThread() {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_stopping = true;
+        }
+
+        m_wake.notify_all();
+        m_thread.join();
+    }
+
+    void RenderThread::set_camera(const Camera &camera, bool moving) {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_camera = camera;
+            m_moving = moving;
+            ++m_camera_version;
+        }
+
+        m_wake.notify_all();
+    }
+
+    Camera RenderThread::camera() const {
+        std::scoped_lock lock(m_mutex);
+        return m_camera;
+    }
+
+    void RenderThread::post(Task task) {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+
+        m_wake.notify_all();
+    }
+
+    void RenderThread::edit_scene(Edit edit) {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_edits.push_back(std::move(edit));
+        }
+
+        m_wake.notify_all();
+    }
+
+    void RenderThread::loop(Camera camera) {
+        uint64_t rendered_version = 0;
+        bool after_motion = false;
+
+        while (true) {
+            bool motion;
+            std::deque<Task> tasks;
+            std::deque<Edit> edits;
+
+            {
+                std::unique_lock lock(m_mutex);
+                m_wake.wait(lock, [&]() {
+                    auto refining = !m_moving && m_progressive.sample_count() < m_max_samples &&
+                        !m_progressive.converged();
+                    return m_stopping || !m_tasks.empty() || !m_edits.empty() ||
+                        m_camera_version != rendered_version || refining;
+                });
+
+                if (m_stopping) {
+                    return;
+                }
+
+                tasks.swap(m_tasks);
+                edits.swap(m_edits);
+                motion = m_camera_version != rendered_version && m_moving;
+
+                if (m_camera_version != rendered_version) {
+                    camera = m_camera;
+
+                    // A camera that stopped after motion frames refines
+                    // from the last one, which already started over.
+                    if (!m_moving && !after_motion) {
+                        m_progressive.reset();
+                    }
+                }
+
+                rendered_version = m_camera_version;
+            }
+
+            for (auto &edit: edits) {
+                edit(m_scene);
+            }
+
+            // Motion frames start over anyway.
+            if (!edits.empty() && !motion) {
+                m_progressive.reset();
+            }
+
+            for (auto &task: tasks) {
+                task(m_scene, camera);
+            }
+
+            if (motion) {
+                m_progressive.render_motion_frame(m_scene, camera, m_pool);
+                after_motion = true;
+            } else if (m_progressive.sample_count() < m_max_samples && !m_progressive.converged()) {
+                m_progressive.render_pass(m_scene, camera, m_pool);
+                after_motion = false;
+            } else {
+                continue;
+            }
+
+            m_on_frame(m_progressive);
+        }
+    }
+}
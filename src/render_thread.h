@@ -0,0 +1,77 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "joytracer.h"
+#include "progressive.h"
+#include "thread_pool.h"
+
+namespace joytracer {
+    /*
+    * Renders a `ProgressiveRenderer` frame on a background thread, so a
+    * viewer's event loop never waits for a render.
+    *
+    * While the camera moves, the thread renders motion frames, one per
+    * camera update. Then it refines the frame pass after pass until it
+    * has `max_samples` or converges, and sleeps until there is something
+    * new to do. `on_frame` is called on the render thread after every
+    * frame, to publish it.
+    */
+    class RenderThread {
+    public:
+        using FrameCallback = std::function<void(const ProgressiveRenderer &progressive)>;
+        using Task = std::function<void(const Scene &scene, const Camera &camera)>;
+        using Edit = std::function<void(Scene &scene)>;
+
+        // `scene`, `pool` and `progressive` must outlive the thread, and
+        // only it may use them until then.
+        RenderThread(Scene &scene, ThreadPool &pool, ProgressiveRenderer &progressive,
+            const Camera &camera, int max_samples, FrameCallback on_frame);
+        // Finishes the current frame, then stops.
+        ~RenderThread();
+
+        RenderThread(const RenderThread&) = delete;
+        RenderThread& operator=(const RenderThread&) = delete;
+
+        // The camera to render from next, with a motion frame while
+        // `moving`, or refining from scratch otherwise. Once a moving
+        // camera stops, set it again with `moving` false to refine from
+        // its last motion frame.
+        void set_camera(const Camera &camera, bool moving);
+
+        // A copy of the latest camera set.
+        Camera camera() const;
+
+        // Runs `task` on the render thread before the next frame, for
+        // work that shouldn't hold up the caller, such as probing a pixel.
+        void post(Task task);
+
+        // Runs `edit` on the render thread before the next frame, which
+        // then starts over. The camera and any motion carry on.
+        void edit_scene(Edit edit);
+    private:
+        Scene &m_scene;
+        ThreadPool &m_pool;
+        ProgressiveRenderer &m_progressive;
+        int m_max_samples;
+        FrameCallback m_on_frame;
+
+        mutable std::mutex m_mutex;
+        std::condition_variable m_wake;
+        Camera m_camera;
+        // Counts camera updates, so the thread knows when it has a new one.
+        uint64_t m_camera_version = 0;
+        bool m_moving = false;
+        std::deque<Task> m_tasks;
+        std::deque<Edit> m_edits;
+        bool m_stopping = false;
+        std::thread m_thread;
+
+        // Starts from its own copy of the first camera, since `m_camera`
+        // may only be read under `m_mutex`.
+        void loop(Camera camera);
+    };
+}
@@ -0,0 +1,94 @@
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+#include "hammersley.h"
+#include "sampler.h"
+
+namespace joytracer {
+    namespace {
+        constexpr auto radical_inverses =
+            hammersley::radicalinverse_vdc_table<HemisphereSampler::max_sample_count>();
+
+        // The splitmix64 finalizer, every input bit flips about half the
+        // output bits.
+        uint64_t mix(uint64_t bits) {
+            bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9u;
+            bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebu;
+            return bits ^ (bits >> 31);
+        }
+
+        // Grid cells hashed per scene unit, far smaller than a pixel seen
+        // from any distance worth rendering.
+        constexpr real cells_per_unit = 4096;
+
+        // The top 24 bits of `bits`, as a fraction.
+        real fraction(uint64_t bits) {
+            return static_cast<real>(static_cast<double>(bits >> 40) * 0x1p-24);
+        }
+    }
+
+    HemisphereMapping parse_hemisphere_mapping(const std::string &name) {
+        if (name == "uniform") {
+            return HemisphereMapping::uniform;
+        }
+
+        if (name == "cosine") {
+            return HemisphereMapping::cosine;
+        }
+
+        throw std::invalid_argument("Unknown hemisphere mapping " + name);
+    }
+
+    HemisphereSampler::HemisphereSampler(std::size_t sample_count, HemisphereMapping mapping, bool rotate) :
+        m_mapping(mapping), m_rotate(rotate) {
+        if (sample_count == 0 || sample_count > max_sample_count) {
+            throw std::invalid_argument("Diffuse samples must be between 1 and " + std::to_string(max_sample_count));
+        }
+
+        for (std::size_t i = 0; i < sample_count; ++i) {
+            auto u = static_cast<double>(i) / static_cast<double>(sample_count);
+            auto phi = radical_inverses[i] * 2.0 * hammersley::pi;
+            m_points.push_back({static_cast<real>(u), static_cast<real>(std::cos(phi)), static_cast<real>(std::sin(phi))});
+            m_directions.push_back(vec3_cast<real>(mapping == HemisphereMapping::cosine ?
+                hammersley::hemispheresample_cos(u, radical_inverses[i]) :
+                hammersley::hemispheresample_uniform(u, radical_inverses[i])));
+        }
+    }
+
+    HemisphereSampler::Rotation HemisphereSampler::rotation(const Vec3 &point, int reflect) const {
+        if (!m_rotate) {
+            return {};
+        }
+
+        uint64_t hash = mix(static_cast<uint64_t>(reflect));
+
+        // Hashes the cell around the point rather than its bits, so that
+        // the scalar and packet kernels, whose hits differ by a few ulps,
+        // agree on the rotation. Rounding centers the cells on round
+        // coordinates, where planes like the floor tend to be.
+        for (auto coordinate: point) {
+            auto cell = static_cast<int64_t>(std::llround(coordinate * cells_per_unit));
+            hash = mix(hash ^ static_cast<uint64_t>(cell));
+        }
+
+        auto angle = fraction(mix(hash)) * 2 * static_cast<real>(hammersley::pi);
+        return {fraction(hash), std::cos(angle), std::sin(angle)};
+    }
+
+    Vec3 HemisphereSampler::direction(std::size_t index, const Rotation &rotation) const {
+        if (!m_rotate) {
+            return m_directions[index];
+        }
+
+        const auto &point = m_points[index];
+        auto u = point.u + rotation.offset;
+        u = u >= 1 ? u - 1 : u;
+        // Both mappings keep the angle, and place u by its cosine.
+        auto cos_theta = m_mapping == HemisphereMapping::cosine ? std::sqrt(1 - u) : 1 - u;
+        auto sin_theta = m_mapping == HemisphereMapping::cosine ? std::sqrt(u) : std::sqrt(u * (2 - u));
+        auto cos_phi = point.cos_phi * rotation.cos_angle - point.sin_phi * rotation.sin_angle;
+        auto sin_phi = point.sin_phi * rotation.cos_angle + point.cos_phi * rotation.sin_angle;
+        return {cos_phi * sin_theta, sin_phi * sin_theta, cos_theta};
+    }
+}
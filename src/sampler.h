@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "joymath.h"
+
+namespace joytracer {
+    enum class HemisphereMapping {
+        // Spread evenly, averaging the light as it comes.
+        uniform,
+        // Denser toward the normal, weighting the light by the cosine of
+        // its angle like a matte surface does, so fewer rays are spent
+        // near the horizon where they matter least.
+        cosine
+    };
+
+    // "uniform" or "cosine", throws `std::invalid_argument` otherwise.
+    HemisphereMapping parse_hemisphere_mapping(const std::string &name);
+
+    /*
+    * The directions of the diffuse rays of a shadowed hit: a 2D Hammersley
+    * set mapped onto the hemisphere around the normal.
+    *
+    * Each hit moves the set by its own Cranley-Patterson rotation, a
+    * random offset wrapped around the unit square, keyed by a hash of its
+    * position and bounce. Neighbouring pixels, the jittered passes of one
+    * pixel and the bounces of a path therefore all see different
+    * directions, and average to the integral instead of sharing the same
+    * artifacts, while a render stays reproducible whatever its threads or
+    * tiles.
+    */
+    class HemisphereSampler {
+    public:
+        /*
+        * The offset of the set at one hit. Its second coordinate wraps
+        * around the normal, so it turns the whole set by an angle.
+        */
+        struct Rotation {
+            real offset = 0;
+            real cos_angle = 1;
+            real sin_angle = 0;
+        };
+
+        // Hammersley coordinates come from a table of this many points,
+        // built at compile time.
+        static constexpr std::size_t max_sample_count = 256;
+
+        // Without rotation, 10 uniform samples are the fixed set every hit
+        // shared before. Throws `std::invalid_argument` on a count of 0 or
+        // above `max_sample_count`.
+        explicit HemisphereSampler(std::size_t sample_count = 10,
+            HemisphereMapping mapping = HemisphereMapping::cosine, bool rotate = true);
+
+        std::size_t sample_count() const {
+            return m_points.size();
+        }
+
+        HemisphereMapping mapping() const {
+            return m_mapping;
+        }
+
+        bool rotates() const {
+            return m_rotate;
+        }
+
+        // The rotation of the set at a hit on `point`, `reflect` bounces
+        // from the end of its path.
+        Rotation rotation(const Vec3 &point, int reflect) const;
+
+        // Direction `index` of the set moved by `rotation`, with z along
+        // the normal.
+        Vec3 direction(std::size_t index, const Rotation &rotation) const;
+    private:
+        // A Hammersley point, with the second coordinate as an angle.
+        struct Point {
+            real u;
+            real cos_phi;
+            real sin_phi;
+        };
+
+        HemisphereMapping m_mapping;
+        bool m_rotate;
+        std::vector<Point> m_points;
+        // The directions without rotation, used as they are when it's off.
+        std::vector<Vec3> m_directions;
+    };
+}
@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "scene_binary.h"
+
+namespace joytracer {
+    using namespace std::string_literals;
+
+    namespace {
+        using namespace scene_binary;
+
+        uint64_t align(uint64_t offset) {
+            return (offset + section_alignment - 1) / section_alignment * section_alignment;
+        }
+
+        void store(double (&out)[3], const std::array<real, 3> &value) {
+            std::copy(value.begin(), value.end(), out);
+        }
+
+        Vec3 load_vec3(const double (&value)[3]) {
+            return Vec3{static_cast<real>(value[0]), static_cast<real>(value[1]), static_cast<real>(value[2])};
+        }
+
+        /*
+        * Collects the arrays of a binary scene file.
+        */
+        class SceneWriter {
+        public:
+            std::vector<SurfaceRecord> surfaces;
+            std::vector<SphereRecord> spheres;
+            std::vector<TriangleRecord> triangles;
+            std::vector<MeshRecord> meshes;
+            std::vector<std::array<double, 3>> vertices;
+            std::vector<FaceRecord> faces;
+            std::vector<NodeRecord> nodes;
+
+            // Returns the first node and the node count.
+            std::pair<uint64_t, uint64_t> add_nodes(const Bvh &bvh) {
+                uint64_t first = nodes.size();
+
+                for (const auto &node: bvh.nodes()) {
+                    NodeRecord record{};
+                    store(record.min, node.bounds.min());
+                    store(record.max, node.bounds.max());
+                    record.offset = node.offset;
+                    record.count = node.count;
+                    record.axis = node.axis;
+                    nodes.push_back(record);
+                }
+
+                return {first, nodes.size() - first};
+            }
+
+            void add_surface(const Surface &surface) {
+                std::visit([&](const auto &s) {
+                    using T = std::decay_t<decltype(s)>;
+
+                    if constexpr (std::is_same_v<T, Floor>) {
+                        surfaces.push_back({SurfaceType::floor, 0});
+                    } else if constexpr (std::is_same_v<T, Sphere>) {
+                        SphereRecord record{};
+                        store(record.center, s.center());
+                        record.radius = s.radius();
+                        store(record.color, s.color().to_rgb());
+                        surfaces.push_back({SurfaceType::sphere, static_cast<uint32_t>(spheres.size())});
+                        spheres.push_back(record);
+                    } else if constexpr (std::is_same_v<T, Triangle>) {
+                        TriangleRecord record{};
+
+                        for (std::size_t i = 0; i < 3; ++i) {
+                            store(record.vertices[i], s.vertices()[i]);
+                        }
+
+                        store(record.color, s.color().to_rgb());
+                        surfaces.push_back({SurfaceType::triangle, static_cast<uint32_t>(triangles.size())});
+                        triangles.push_back(record);
+                    } else if constexpr (std::is_same_v<T, Instance>) {
+                        throw std::runtime_error("The binary scene format cannot store instances");
+                    } else {
+                        MeshRecord record{};
+                        record.first_vertex = vertices.size();
+                        record.vertex_count = s.vertices()->size();
+                        record.first_face = faces.size();
+                        record.face_count = s.indices().size();
+                        std::tie(record.first_node, record.node_count) = add_nodes(s.bvh());
+                        store(record.color, s.color().to_rgb());
+
+                        for (const auto &vertex: *s.vertices()) {
+                            vertices.push_back({vertex[0], vertex[1], vertex[2]});
+                        }
+
+                        for (const auto &face: s.indices()) {
+                            faces.push_back({{face[0], face[1], face[2]}});
+                        }
+
+                        surfaces.push_back({SurfaceType::mesh, static_cast<uint32_t>(meshes.size())});
+                        meshes.push_back(record);
+                    }
+                }, surface);
+            }
+        };
+
+        template<typename T>
+        void write_section(std::ofstream &out, const SectionRange &range, const std::vector<T> &records) {
+            out.seekp(static_cast<std::streamoff>(range.offset));
+            out.write(reinterpret_cast<const char *>(records.data()),
+                static_cast<std::streamsize>(records.size() * sizeof(T)));
+        }
+
+        /*
+        * A section of the mapped file, seen as an array of records.
+        */
+        template<typename T>
+        class SectionView {
+        public:
+            SectionView(const char *data, std::size_t size, const SectionRange &range) {
+                static_assert(std::is_trivially_copyable_v<T>);
+
+                if (range.offset % alignof(T) != 0 || range.offset > size ||
+                    range.count > (size - range.offset) / sizeof(T)) {
+                    throw std::runtime_error("Binary scene section out of the file");
+                }
+
+                m_records = reinterpret_cast<const T *>(data + range.offset);
+                m_count = range.count;
+            }
+
+            // Records `[first, first + count)`, checked against the section.
+            const T *range(uint64_t first, uint64_t count) const {
+                if (first > m_count || count > m_count - first) {
+                    throw std::runtime_error("Binary scene record out of its section");
+                }
+
+                return m_records + first;
+            }
+
+            const T &operator[](uint64_t index) const {
+                return *range(index, 1);
+            }
+
+            uint64_t size() const {
+                return m_count;
+            }
+        private:
+            const T *m_records;
+            uint64_t m_count;
+        };
+
+        Bvh load_bvh(const SectionView<NodeRecord> &nodes, uint64_t first, uint64_t count,
+            std::size_t primitive_count) {
+            const auto *records = nodes.range(first, count);
+            std::vector<Bvh::Node> bvh_nodes;
+            bvh_nodes.reserve(count);
+
+            std::transform(records, records + count, std::back_inserter(bvh_nodes), [](const NodeRecord &r) {
+                return Bvh::Node{BoundingBox(load_vec3(r.min), load_vec3(r.max)), r.offset, r.count, r.axis};
+            });
+
+            return Bvh(std::move(bvh_nodes), static_cast<uint32_t>(primitive_count));
+        }
+    }
+
+    bool is_binary_scene(const std::string &filename) {
+        char start[sizeof(scene_binary::magic)] = {};
+        std::ifstream in(filename, std::ios::binary);
+        in.read(start, sizeof(start));
+        return in && std::equal(std::begin(start), std::end(start), std::begin(scene_binary::magic));
+    }
+
+    void save_binary_scene(const Scene &scene, const std::string &filename) {
+        SceneWriter writer;
+        Header header{};
+        std::copy(std::begin(magic), std::end(magic), header.magic);
+        header.version = version;
+        header.byte_order = byte_order;
+        header.real_size = sizeof(real);
+        store(header.sky_color, scene.m_sky_color.to_rgb());
+        store(header.sunlight_normal, scene.m_sunlight_normal);
+        header.diffuse_ray_count = static_cast<uint32_t>(scene.m_sampler.sample_count());
+        header.hemisphere_mapping = static_cast<uint32_t>(scene.m_sampler.mapping());
+        header.rotate_samples = scene.m_sampler.rotates();
+        std::tie(header.first_node, header.node_count) = writer.add_nodes(scene.m_bvh);
+
+        // Bounded surfaces first, in BVH order, so the loader finds them
+        // sorted.
+        for (const auto &s: scene.m_surfaces) {
+            writer.add_surface(s);
+        }
+
+        for (const auto &s: scene.m_unbounded_surfaces) {
+            writer.add_surface(s);
+        }
+
+        auto offset = align(sizeof(Header));
+        auto add_section = [&](Section section, uint64_t count, std::size_t record_size) {
+            header.sections[section] = {offset, count};
+            offset = align(offset + count * record_size);
+        };
+        add_section(Section::surfaces, writer.surfaces.size(), sizeof(SurfaceRecord));
+        add_section(Section::spheres, writer.spheres.size(), sizeof(SphereRecord));
+        add_section(Section::triangles, writer.triangles.size(), sizeof(TriangleRecord));
+        add_section(Section::meshes, writer.meshes.size(), sizeof(MeshRecord));
+        add_section(Section::vertices, writer.vertices.size(), sizeof(std::array<double, 3>));
+        add_section(Section::faces, writer.faces.size(), sizeof(FaceRecord));
+        add_section(Section::nodes, writer.nodes.size(), sizeof(NodeRecord));
+
+        std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+
+        if (!out) {
+            throw std::runtime_error("Cannot open "s + filename + " for writing");
+        }
+
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        write_section(out, header.sections[Section::surfaces], writer.surfaces);
+        write_section(out, header.sections[Section::spheres], writer.spheres);
+        write_section(out, header.sections[Section::triangles], writer.triangles);
+        write_section(out, header.sections[Section::meshes], writer.meshes);
+        write_section(out, header.sections[Section::vertices], writer.vertices);
+        write_section(out, header.sections[Section::faces], writer.faces);
+        write_section(out, header.sections[Section::nodes], writer.nodes);
+
+        // Pad the last section, so every section is whole in the file.
+        out.seekp(static_cast<std::streamoff>(offset - 1));
+        out.put(0);
+
+        if (!out) {
+            throw std::runtime_error("Failed writing "s + filename);
+        }
+    }
+
+    Scene load_binary_scene(const std::string &filename) {
+        namespace bip = boost::interprocess;
+        bip::file_mapping file;
+        bip::mapped_region region;
+
+        try {
+            file = bip::file_mapping(filename.c_str(), bip::read_only);
+            region = bip::mapped_region(file, bip::read_only);
+        } catch (const bip::interprocess_exception &e) {
+            throw std::runtime_error("Cannot map "s + filename + ": " + e.what());
+        }
+
+        const auto *data = static_cast<const char *>(region.get_address());
+        auto size = region.get_size();
+        Header header;
+
+        if (size < sizeof(header)) {
+            throw std::runtime_error(filename + " is too short for a binary scene"s);
+        }
+
+        std::memcpy(&header, data, sizeof(header));
+
+        if (!std::equal(std::begin(magic), std::end(magic), header.magic) ||
+            header.version != version || header.byte_order != byte_order) {
+            throw std::runtime_error(filename + " is not a binary scene of this version and byte order"s);
+        }
+
+        bool prebuilt = header.real_size == sizeof(real);
+        SectionView<SurfaceRecord> surface_records(data, size, header.sections[Section::surfaces]);
+        SectionView<SphereRecord> spheres(data, size, header.sections[Section::spheres]);
+        SectionView<TriangleRecord> triangles(data, size, header.sections[Section::triangles]);
+        SectionView<MeshRecord> meshes(data, size, header.sections[Section::meshes]);
+        SectionView<std::array<double, 3>> vertices(data, size, header.sections[Section::vertices]);
+        SectionView<FaceRecord> faces(data, size, header.sections[Section::faces]);
+        SectionView<NodeRecord> nodes(data, size, header.sections[Section::nodes]);
+
+        std::vector<Surface> surfaces;
+        surfaces.reserve(surface_records.size());
+        std::size_t bounded_count = 0;
+
+        for (uint64_t i = 0; i < surface_records.size(); ++i) {
+            const auto &record = surface_records[i];
+
+            switch (record.type) {
+            case SurfaceType::floor:
+                surfaces.push_back(Floor());
+                break;
+            case SurfaceType::sphere: {
+                const auto &sphere = spheres[record.index];
+                surfaces.push_back(Sphere(static_cast<real>(sphere.radius), load_vec3(sphere.center),
+                    Color::from_rgb(load_vec3(sphere.color))));
+                break;
+            }
+            case SurfaceType::triangle: {
+                const auto &triangle = triangles[record.index];
+                surfaces.push_back(Triangle({
+                        load_vec3(triangle.vertices[0]),
+                        load_vec3(triangle.vertices[1]),
+                        load_vec3(triangle.vertices[2])
+                    }, Color::from_rgb(load_vec3(triangle.color))));
+                break;
+            }
+            case SurfaceType::mesh: {
+                const auto &mesh = meshes[record.index];
+
+                if (mesh.face_count == 0) {
+                    throw std::runtime_error("Empty mesh in "s + filename);
+                }
+
+                const auto *first_vertex = vertices.range(mesh.first_vertex, mesh.vertex_count);
+                const auto *first_face = faces.range(mesh.first_face, mesh.face_count);
+                auto mesh_vertices = std::make_shared<std::vector<Vec3>>();
+                mesh_vertices->reserve(mesh.vertex_count);
+                std::vector<std::array<uint32_t, 3>> mesh_faces;
+                mesh_faces.reserve(mesh.face_count);
+
+                std::transform(first_vertex, first_vertex + mesh.vertex_count,
+                    std::back_inserter(*mesh_vertices), [](const auto &v) {
+                        return Vec3{static_cast<real>(v[0]), static_cast<real>(v[1]), static_cast<real>(v[2])};
+                    });
+                std::transform(first_face, first_face + mesh.face_count,
+                    std::back_inserter(mesh_faces), [](const FaceRecord &f) {
+                        return std::array<uint32_t, 3>{f.indices[0], f.indices[1], f.indices[2]};
+                    });
+
+                auto color = Color::from_rgb(load_vec3(mesh.color));
+
+                if (prebuilt) {
+                    auto bvh = load_bvh(nodes, mesh.first_node, mesh.node_count, mesh_faces.size());
+                    surfaces.push_back(TriangleMesh(std::move(mesh_vertices), std::move(mesh_faces),
+                        color, std::move(bvh)));
+                } else {
+                    surfaces.push_back(TriangleMesh(std::move(mesh_vertices), std::move(mesh_faces), color));
+                }
+
+                break;
+            }
+            default:
+                throw std::runtime_error("Unknown surface type in "s + filename);
+            }
+
+            bounded_count += std::visit(BoundsVisitor(), surfaces.back()).has_value();
+        }
+
+        auto sky_color = Color::from_rgb(load_vec3(header.sky_color));
+        auto sunlight_normal = Normal3(load_vec3(header.sunlight_normal));
+
+        if (header.diffuse_ray_count == 0 || header.diffuse_ray_count > HemisphereSampler::max_sample_count ||
+            header.hemisphere_mapping > static_cast<uint32_t>(HemisphereMapping::cosine) ||
+            header.rotate_samples > 1) {
+            throw std::runtime_error("Invalid diffuse sampler in "s + filename);
+        }
+
+        HemisphereSampler sampler(header.diffuse_ray_count,
+            static_cast<HemisphereMapping>(header.hemisphere_mapping), header.rotate_samples != 0);
+        auto scene = prebuilt ?
+            Scene(std::move(surfaces), sky_color, sunlight_normal,
+                load_bvh(nodes, header.first_node, header.node_count, bounded_count)) :
+            Scene(std::move(surfaces), sky_color, sunlight_normal);
+        scene.set_sampler(sampler);
+        return scene;
+    }
+} // namespace joytracer
@@ -0,0 +1,117 @@
+#pragma once
+#include <string>
+
+#include "joytracer.h"
+
+namespace joytracer {
+    /*
+    * A binary scene file, loaded without parsing.
+    *
+    * After a fixed header come flat arrays, one per section, each aligned
+    * to `section_alignment` bytes: the surface list, spheres, triangles,
+    * meshes, mesh vertices and faces, and the BVH nodes of the scene and
+    * of every mesh. Bounded surfaces and mesh faces are stored in the
+    * order of their BVH leaves, so loading only copies the arrays into
+    * place. Numbers are native endian doubles and unsigned integers, and
+    * the header records the byte order of the machine that wrote them.
+    */
+    namespace scene_binary {
+        constexpr char magic[8] = {'J', 'O', 'Y', 'S', 'C', 'E', 'N', 'E'};
+        constexpr uint32_t version = 2;
+        constexpr uint32_t byte_order = 0x01020304;
+        constexpr std::size_t section_alignment = 64;
+
+        enum class SurfaceType : uint32_t {
+            floor,
+            sphere,
+            triangle,
+            mesh
+        };
+
+        enum Section {
+            surfaces,
+            spheres,
+            triangles,
+            meshes,
+            vertices,
+            faces,
+            nodes,
+            section_count
+        };
+
+        struct SectionRange {
+            uint64_t offset;
+            uint64_t count;
+        };
+
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t byte_order;
+            // `sizeof(real)` of the writer. BVHs built in the other
+            // precision may not bound the rounded vertices, so the loader
+            // rebuilds them.
+            uint32_t real_size;
+            uint32_t reserved;
+            double sky_color[3];
+            double sunlight_normal[3];
+            // The scene's `HemisphereSampler`: its ray count, its
+            // `HemisphereMapping` and whether it rotates, 0 or 1.
+            uint32_t diffuse_ray_count;
+            uint32_t hemisphere_mapping;
+            uint32_t rotate_samples;
+            uint32_t sampler_padding;
+            // The scene's BVH nodes, within the `nodes` section.
+            uint64_t first_node, node_count;
+            SectionRange sections[section_count];
+        };
+
+        // Indexes the array of its type, except for floors.
+        struct SurfaceRecord {
+            SurfaceType type;
+            uint32_t index;
+        };
+
+        struct SphereRecord {
+            double center[3];
+            double radius;
+            double color[3];
+        };
+
+        struct TriangleRecord {
+            double vertices[3][3];
+            double color[3];
+        };
+
+        // Faces index the mesh's own vertices.
+        struct MeshRecord {
+            uint64_t first_vertex, vertex_count;
+            uint64_t first_face, face_count;
+            uint64_t first_node, node_count;
+            double color[3];
+        };
+
+        struct FaceRecord {
+            uint32_t indices[3];
+        };
+
+        struct NodeRecord {
+            double min[3];
+            double max[3];
+            uint32_t offset;
+            uint16_t count;
+            uint8_t axis;
+            uint8_t padding;
+        };
+    }
+
+    // True if `filename` starts like a binary scene file.
+    bool is_binary_scene(const std::string &filename);
+
+    // Writes `scene` with its BVHs, for `load_binary_scene`.
+    void save_binary_scene(const Scene &scene, const std::string &filename);
+
+    // Maps a file written by `save_binary_scene` into memory and builds the
+    // scene from it. Throws `std::runtime_error` on a malformed file.
+    Scene load_binary_scene(const std::string &filename);
+}
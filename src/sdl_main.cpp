@@ -1,66 +1,267 @@
 #include <algorithm>
+#include <array>
+#include <cmath>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <mutex>
 
+#include "file_watcher.h"
+#include "framebuffer.h"
+#include "irradiance_cache.h"
 #include "joymath.h"
 #include "joytracer.h"
+#include "progressive.h"
+#include "render_thread.h"
+#include "scene_binary.h"
 #include "sdl_wrapper.h"
 #include "serialization.h"
+#include "triple_buffer.h"
 
 int main(int argc, char** argv) {
     const int screen_width = 640;
     const int screen_height = 480;
 
-    if (argc != 2) {
-        std::cerr << "No input scene specified!\n";
+    if (argc < 2 || argc > 4) {
+        std::cerr <<
+            "Usage: joytracer <scene.xml> [threads] [samples]\n"
+            "W, A, S and D move, R and F rise and sink, shift moves faster.\n"
+            "The arrow keys or dragging the mouse turn, clicking prints a color.\n"
+            "Saving the scene file shows the changes.\n";
         return 1;
     }
 
-    joytracer::Scene test_scene = joytracer::load_scene(argv[1]);
+    joytracer::ThreadPool pool(argc >= 3 ?
+        std::stoul(argv[2]) :
+        joytracer::ThreadPool::default_thread_count());
+    // Samples per pixel to converge to, one pass each.
+    const int max_samples = argc == 4 ? std::stoi(argv[3]) : 16;
+    const bool binary_scene = joytracer::is_binary_scene(argv[1]);
+    joytracer::SceneReloader reloader(argv[1], &pool);
+    joytracer::Scene test_scene = binary_scene ? joytracer::load_scene(argv[1], &pool) : reloader.load();
+    // The scene stays put, so every pass reuses the diffuse light of the
+    // previous ones.
+    test_scene.set_irradiance_cache(std::make_shared<joytracer::IrradianceCache>());
+    test_scene.set_render_stats(std::make_shared<joytracer::RenderStats>());
     sdl_wrapper::SDL sdl;
     sdl_wrapper::SDLWindow sdl_window("Joytracer", screen_width, screen_height);
     sdl_wrapper::SDLSurface main_surface = sdl_window.get_surface();
-    sdl_wrapper::SDLSurface backbuffer(0, screen_width, screen_height, 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
-    joytracer::Camera fixed_camera{};
-    fixed_camera.set_focal_distance(1.0);
-    fixed_camera.set_plane_size(1.0, static_cast<double>(screen_height) / static_cast<double>(screen_width));
-    fixed_camera.set_position(joytracer::Vec3({0.0, 0.0, 1.77}));
-    fixed_camera.set_orientation({0.0, std::acos(-1) * 0.50, 0.0});
-    auto ticks = SDL_GetTicks();
-    auto fixed_frame = fixed_camera.render_scene(test_scene, screen_width, screen_height);
-    ticks = SDL_GetTicks() - ticks;
-    std::cout << "Initial render took " << ticks << " ticks.\n";
-
-    // Scoped lock on the SDL surface.
-    {
-        std::scoped_lock backbuffer_lock(backbuffer);
-
-        for (int y = 0; y < screen_height; ++y) {
-            for (int x = 0; x < screen_width; ++x) {
-                auto colorvalue = fixed_frame[y * screen_width + x].to_rgb();
-                backbuffer.set_pixel(x, y, 0xff000000 |
-                    (static_cast<uint32_t>(255 * colorvalue[0])) |
-                    (static_cast<uint32_t>(255 * colorvalue[1])) << 8 |
-                    (static_cast<uint32_t>(255 * colorvalue[2])) << 16);
+    // The render thread packs frames into one of these while the event
+    // loop shows another.
+    std::array<std::unique_ptr<sdl_wrapper::SDLSurface>, 3> backbuffers;
+
+    for (auto &backbuffer: backbuffers) {
+        backbuffer = std::make_unique<sdl_wrapper::SDLSurface>(
+            0, screen_width, screen_height, 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
+    }
+
+    joytracer::TripleBuffer frames;
+    const auto frame_event = sdl_wrapper::register_event();
+    joytracer::Camera camera{};
+    camera.set_focal_distance(1.0);
+    camera.set_plane_size(1.0, static_cast<double>(screen_height) / static_cast<double>(screen_width));
+    camera.set_position(joytracer::Vec3({0.0, 0.0, 1.77}));
+    camera.set_orientation({0.0, std::acos(-1) * 0.50, 0.0});
+    joytracer::ProgressiveRenderer progressive(screen_width, screen_height);
+    // Flat areas stop early, the remaining passes go to noisy pixels.
+    progressive.set_adaptive(0.01);
+    // Keep moving at 30 frames per second, with one bounce.
+    progressive.set_motion_target(33, 1);
+    auto last_ticks = SDL_GetTicks();
+    bool moving = false;
+
+    // Scene units per second and radians per second or per dragged pixel.
+    const double move_speed = 2.0;
+    const double turn_speed = 1.5;
+    const double drag_speed = 0.005;
+    // Turns dragged since the last frame, and whether the button went down
+    // for a drag rather than a click.
+    double dragged_pitch = 0;
+    double dragged_yaw = 0;
+    bool dragging = false;
+
+    // Moves the camera by the keys held and the mouse drags, over
+    // `seconds`. Returns false if it stayed put.
+    auto move_camera = [&](double seconds) {
+        const Uint8 *keys = SDL_GetKeyboardState(nullptr);
+        auto axis = [&](SDL_Scancode positive, SDL_Scancode negative) {
+            return static_cast<double>(keys[positive]) - static_cast<double>(keys[negative]);
+        };
+        auto forward = axis(SDL_SCANCODE_W, SDL_SCANCODE_S);
+        auto left = axis(SDL_SCANCODE_A, SDL_SCANCODE_D);
+        auto up = axis(SDL_SCANCODE_R, SDL_SCANCODE_F);
+        auto pitch = axis(SDL_SCANCODE_UP, SDL_SCANCODE_DOWN) * turn_speed * seconds + dragged_pitch;
+        auto yaw = axis(SDL_SCANCODE_LEFT, SDL_SCANCODE_RIGHT) * turn_speed * seconds + dragged_yaw;
+        dragged_pitch = 0;
+        dragged_yaw = 0;
+
+        if (forward == 0 && left == 0 && up == 0 && pitch == 0 && yaw == 0) {
+            return false;
+        }
+
+        auto orientation = camera.orientation();
+        // Short of straight up or down, where the view would flip.
+        orientation[0] = std::clamp(orientation[0] + pitch, -1.5, 1.5);
+        orientation[1] += yaw;
+        camera.set_orientation(orientation);
+
+        using joytracer::operator+;
+        using joytracer::operator*;
+        auto distance = move_speed * seconds * (keys[SDL_SCANCODE_LSHIFT] || keys[SDL_SCANCODE_RSHIFT] ? 4 : 1);
+        auto horizontal = std::cos(orientation[0]);
+        joytracer::Vec3 look{
+            static_cast<joytracer::real>(horizontal * std::cos(orientation[1])),
+            static_cast<joytracer::real>(horizontal * std::sin(orientation[1])),
+            static_cast<joytracer::real>(std::sin(orientation[0]))};
+        joytracer::Vec3 side{
+            static_cast<joytracer::real>(-std::sin(orientation[1])),
+            static_cast<joytracer::real>(std::cos(orientation[1])),
+            0};
+        joytracer::Vec3 vertical{0, 0, 1};
+        camera.set_position(camera.position() +
+            look * static_cast<joytracer::real>(forward * distance) +
+            side * static_cast<joytracer::real>(left * distance) +
+            vertical * static_cast<joytracer::real>(up * distance));
+        return true;
+    };
+
+    // Only used on the render thread.
+    auto start_ticks = SDL_GetTicks();
+
+    auto show_frame = [&](const joytracer::ProgressiveRenderer &renderer) {
+        auto &backbuffer = *backbuffers[frames.back()];
+
+        {
+            // Scoped lock on the SDL surface.
+            std::scoped_lock backbuffer_lock(backbuffer);
+            const auto &format = backbuffer.format();
+            joytracer::pack_frame(renderer.frame(), screen_width, screen_height, {
+                backbuffer.pixels(), backbuffer.pitch(),
+                format.Rshift, format.Gshift, format.Bshift, format.Amask});
+        }
+
+        frames.publish();
+        sdl_wrapper::push_event(frame_event);
+
+        if (renderer.sample_count() == 0) {
+            // A preview or motion frame, refining starts after it.
+            start_ticks = SDL_GetTicks();
+            return;
+        }
+
+        if (renderer.sample_count() == 1 || renderer.sample_count() == max_samples ||
+            renderer.converged()) {
+            std::cout << renderer.sample_count() << " samples after "
+                << SDL_GetTicks() - start_ticks << " ticks, "
+                << renderer.active_pixel_count() << " pixels still sampling.\n";
+        }
+
+        if (renderer.sample_count() == max_samples || renderer.converged()) {
+            std::cout << test_scene.render_stats()->to_json();
+        }
+    };
+
+    joytracer::RenderThread render_thread(test_scene, pool, progressive, camera, max_samples, show_frame);
+
+    // Parses the saved scene on the watcher's thread, the render thread
+    // only swaps the changes in before its next frame.
+    auto reload_scene = [&]() {
+        auto start = SDL_GetTicks();
+
+        try {
+            auto update = reloader.reload();
+
+            if (!update) {
+                return;
             }
+
+            std::cout << (update->scene ? "Reloaded the scene" :
+                    "Updated " + std::to_string(update->surfaces.size()) + " surfaces")
+                << " in " << SDL_GetTicks() - start << " ticks.\n";
+            render_thread.edit_scene([update = std::make_shared<joytracer::SceneUpdate>(std::move(*update))](
+                joytracer::Scene &scene) {
+                update->apply(scene);
+            });
+        } catch (const std::exception &e) {
+            std::cerr << "Keeping the scene, reloading failed: " << e.what() << '\n';
+        }
+    };
+
+    std::unique_ptr<joytracer::FileWatcher> scene_watcher;
+
+    if (!binary_scene) {
+        try {
+            scene_watcher = std::make_unique<joytracer::FileWatcher>(argv[1], reload_scene);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << ", the scene won't reload.\n";
         }
     }
 
+    // Moves the camera by the keys held and the drags since the last call,
+    // and hands it to the render thread, or tells it the camera stopped.
+    auto update_camera = [&]() {
+        auto ticks = SDL_GetTicks();
+        // A key held down after a wait doesn't jump.
+        auto seconds = std::min((ticks - last_ticks) / 1000.0, 0.05);
+        last_ticks = ticks;
+
+        if (move_camera(seconds)) {
+            moving = true;
+            render_thread.set_camera(camera, true);
+        } else if (moving) {
+            moving = false;
+            render_thread.set_camera(camera, false);
+        }
+    };
+
+    auto repaint = [&]() {
+        backbuffers[frames.front()]->blit_to(main_surface);
+        sdl_window.update_surface();
+    };
+
     sdl_wrapper::quick_and_dirty_sdl_loop(
-        // repaint
-        [&]() -> void {
-            backbuffer.blit_to(main_surface);
-            sdl_window.update_surface();
-        },
-        // onclick
+        repaint,
+        // onclick: probe on the render thread, which has the scene
         [&](int x, int y) -> void {
-            auto color = fixed_camera.test_point(test_scene, screen_width, screen_height, x, y).to_rgb();
-            std::cout
-                << "Color of (" << x << "," << y << "): "
-                << color[0] << ", " << color[1] << ", " << color[2] << ", " << '\n';
+            if (dragging) {
+                return;
+            }
+
+            render_thread.post([=](const joytracer::Scene &scene, const joytracer::Camera &view) {
+                auto color = view.test_point(scene, screen_width, screen_height, x, y).to_rgb();
+                std::cout
+                    << "Color of (" << x << "," << y << "): "
+                    << color[0] << ", " << color[1] << ", " << color[2] << ", " << '\n';
+            });
+        },
+        // onevent: show new frames, and move the camera. While it moves,
+        // each motion frame shown moves it again; otherwise input does.
+        [&](const SDL_Event &event) -> void {
+            if (event.type == frame_event) {
+                if (frames.acquire()) {
+                    repaint();
+                }
+
+                if (moving) {
+                    update_camera();
+                }
+
+                return;
+            }
+
+            if (event.type == SDL_MOUSEBUTTONDOWN) {
+                dragging = false;
+            } else if (event.type == SDL_MOUSEMOTION && (event.motion.state & SDL_BUTTON_LMASK)) {
+                dragged_yaw -= event.motion.xrel * drag_speed;
+                dragged_pitch -= event.motion.yrel * drag_speed;
+                dragging = true;
+            }
+
+            if (!moving && (event.type == SDL_KEYDOWN || event.type == SDL_MOUSEMOTION)) {
+                update_camera();
+            }
         }
     );
     return 0;
@@ -90,23 +90,40 @@ namespace sdl_wrapper {
 
     void quick_and_dirty_sdl_loop(
         const std::function<void()> &repaint,
-        const std::function<void(int x, int y)> &onclick
+        const std::function<void(int x, int y)> &onclick,
+        const std::function<void(const SDL_Event &event)> &onevent
     ) {
-        while (true) {
-            // Get the next event
-            SDL_Event event;
-
-            if (SDL_PollEvent(&event) != 0) {
-                if (event.type == SDL_QUIT) {
-                    // Break out of the loop on quit
-                    break;
-                }
-                if (event.type == SDL_MOUSEBUTTONUP) {
-                    onclick(event.button.x, event.button.y);
-                }
+        SDL_Event event;
 
+        while (SDL_WaitEvent(&event) != 0) {
+            if (event.type == SDL_QUIT) {
+                // Break out of the loop on quit
+                break;
+            }
+            if (event.type == SDL_MOUSEBUTTONUP) {
+                onclick(event.button.x, event.button.y);
+            }
+            if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED) {
                 repaint();
             }
+
+            onevent(event);
+        }
+    }
+
+    Uint32 register_event() {
+        auto type = SDL_RegisterEvents(1);
+
+        if (type == static_cast<Uint32>(-1)) {
+            throw std::runtime_error("SDL_RegisterEvents failed! SDL_Error: "s + SDL_GetError());
         }
+
+        return type;
+    }
+
+    void push_event(Uint32 type) {
+        SDL_Event event{};
+        event.type = type;
+        SDL_PushEvent(&event);
     }
 } // namespace sdl_wrapper
@@ -40,6 +40,20 @@ namespace sdl_wrapper {
         void unlock();
         bool try_lock();
         void set_pixel(int x, int y, uint32_t pixel);
+
+        // The pixel memory, while locked.
+        void *pixels() const {
+            return m_surface->pixels;
+        }
+
+        // Bytes from one row of pixels to the next.
+        int pitch() const {
+            return m_surface->pitch;
+        }
+
+        const SDL_PixelFormat &format() const {
+            return *m_surface->format;
+        }
     };
 
     class SDLWindow {
@@ -65,6 +79,19 @@ namespace sdl_wrapper {
         void update_surface();
     };
 
+    // Runs until the window closes, asleep in `SDL_WaitEvent` between
+    // events, so an idle window costs no CPU. `repaint` runs when the
+    // window needs redrawing and `onclick` on mouse clicks. Every event
+    // but quitting also goes to `onevent`, including those of other
+    // threads' `push_event` calls.
     void quick_and_dirty_sdl_loop(const std::function<void()> &repaint,
-        const std::function<void(int x, int y)> &onclick);
+        const std::function<void(int x, int y)> &onclick,
+        const std::function<void(const SDL_Event &event)> &onevent = [](const SDL_Event&) {});
+
+    // Reserves an event type for `push_event`.
+    Uint32 register_event();
+
+    // Wakes the event loop with an event of `type`. Safe to call from any
+    // thread.
+    void push_event(Uint32 type);
 }
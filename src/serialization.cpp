@@ -1,19 +1,27 @@
+#include <cmath>
+#include <filesystem>
 #include <map>
+#include <memory>
+#include <stdexcept>
 
 #include <boost/property_tree/xml_parser.hpp>
 
+#include "irradiance_cache.h"
+#include "mesh_import.h"
+#include "scene_binary.h"
 #include "serialization.h"
 #include "joymath.h"
 
 namespace joytracer {
     namespace pt = boost::property_tree;
 
-    /// Custom translator for vec3
+    /// Custom translator for vec3, or other short arrays
+    template<class T = real, std::size_t N = 3>
     class Vec3Translator
     {
     public:
         typedef std::string           internal_type;
-        typedef std::array<double, 3> external_type;
+        typedef std::array<T, N>      external_type;
 
         /// Converts a string to vec3.
         /// @str: The comma separated representation of a vec3.
@@ -21,59 +29,89 @@ namespace joytracer {
         boost::optional<external_type> get_value(const internal_type& str)
         {
             std::stringstream ss(str);
-            std::array<double, 3> result;
+            external_type result;
 
-            for (double &d: result) {
+            for (T &d: result) {
                 if (!ss.good()) {
                     return boost::optional<external_type>(boost::none);
                 }
 
                 std::string substr;
                 std::getline(ss, substr, ',');
-                d = std::stod(substr);
+                d = static_cast<T>(std::stod(substr));
             }
 
             return boost::optional<external_type>(result);
         }
     };
 
-    Scene load_scene(const std::string &filename) {
-        pt::ptree pt;
-        std::vector<Surface> surfaces;
-        std::array<double, 3> sky_color;
-        std::array<double, 3> sunlight_normal;
+    /*
+    * Parses the top level elements of an XML scene one at a time, into
+    * surfaces and settings that outlive a reload.
+    */
+    class SceneReloader::Parser {
+    public:
+        Parser(std::string filename, ThreadPool *pool);
 
-        read_xml(filename, pt);
+        Parser(const Parser&) = delete;
+        Parser& operator=(const Parser&) = delete;
+
+        bool handles(const std::string &name) const {
+            return m_node_handlers.count(name) != 0;
+        }
+
+        // Parses a top level element, appending its surfaces to `surfaces`.
+        void parse(const pt::ptree::value_type &node) {
+            m_node_handlers.at(node.first)(node);
+        }
+
+        std::vector<Surface> surfaces;
+        Vec3 sky_color{0, 0, 0};
+        Vec3 sunlight_normal{0, 0, 0};
+        HemisphereSampler sampler;
+        std::map<std::string, std::shared_ptr<const Prototype>> prototypes;
+    private:
+        std::string m_filename;
+        ThreadPool *m_pool;
+        std::map<std::string, const std::function<void(const pt::ptree::value_type &)>> m_node_handlers;
+    };
 
-        std::map<std::string, const std::function<void(const pt::ptree::value_type &)>> node_handlers {
-            {"floor", [&surfaces](const pt::ptree::value_type &node){
+    SceneReloader::Parser::Parser(std::string filename, ThreadPool *pool) :
+        m_filename(std::move(filename)), m_pool(pool), m_node_handlers{
+            {"floor", [this](const pt::ptree::value_type &node){
                 surfaces.push_back(Floor());
             }},
-            {"sphere", [&surfaces](const pt::ptree::value_type &node){
-                double radius = node.second.get("radius", 0.0);
-                auto center = node.second.get("center", std::array{0.0, 0.0, 0.0}, Vec3Translator());
-                auto color = node.second.get("color", std::array{0.0, 0.0, 0.0}, Vec3Translator());
+            {"sphere", [this](const pt::ptree::value_type &node){
+                real radius = node.second.get("radius", real(0));
+                auto center = node.second.get("center", Vec3{0, 0, 0}, Vec3Translator<>());
+                auto color = node.second.get("color", Vec3{0, 0, 0}, Vec3Translator<>());
                 surfaces.push_back(Sphere(
                     radius, center, Color::from_rgb(color)
                 ));
             }},
-            {"sky-color", [&sky_color](const pt::ptree::value_type &node){
-                sky_color = node.second.get_value(std::array{0.0, 0.0, 0.0}, Vec3Translator());
+            {"sky-color", [this](const pt::ptree::value_type &node){
+                sky_color = node.second.get_value(Vec3{0, 0, 0}, Vec3Translator<>());
             }},
-            {"sunlight-normal", [&sunlight_normal](const pt::ptree::value_type &node){
-                sunlight_normal = node.second.get_value(std::array{0.0, 0.0, 0.0}, Vec3Translator());
+            {"sunlight-normal", [this](const pt::ptree::value_type &node){
+                sunlight_normal = node.second.get_value(Vec3{0, 0, 0}, Vec3Translator<>());
             }},
-            {"triangle", [&surfaces](const pt::ptree::value_type &node){
+            {"sampler", [this](const pt::ptree::value_type &node){
+                sampler = HemisphereSampler(
+                    node.second.get("<xmlattr>.diffuse-rays", HemisphereSampler().sample_count()),
+                    parse_hemisphere_mapping(node.second.get("<xmlattr>.mapping", std::string("cosine"))),
+                    node.second.get("<xmlattr>.rotate", true));
+            }},
+            {"triangle", [this](const pt::ptree::value_type &node){
                 std::array<Vec3, 3> vertices;
-                std::array<double, 3> color;
+                std::array<real, 3> color;
                 auto vert_iterator = vertices.begin();
 
                 std::map<std::string, const std::function<void(const pt::ptree::value_type &)>> node_handlers {
                     {"vert", [&vert_iterator](const pt::ptree::value_type &node){
-                        *(vert_iterator++) = node.second.get_value(std::array{0.0, 0.0, 0.0}, Vec3Translator());
+                        *(vert_iterator++) = node.second.get_value(Vec3{0, 0, 0}, Vec3Translator<>());
                     }},
                     {"color", [&color](const pt::ptree::value_type &node){
-                        color = node.second.get_value(std::array{0.0, 0.0, 0.0}, Vec3Translator());
+                        color = node.second.get_value(Vec3{0, 0, 0}, Vec3Translator<>());
                     }},
                 };
 
@@ -84,13 +122,284 @@ namespace joytracer {
 
                 surfaces.push_back(Triangle(vertices, Color::from_rgb(color)));
             }},
+            {"mesh", [this](const pt::ptree::value_type &node){
+                auto vertices = std::make_shared<std::vector<Vec3>>();
+                std::vector<std::array<uint32_t, 3>> faces;
+                std::array<real, 3> color = node.second.get("<xmlattr>.color", Vec3{0, 0, 0}, Vec3Translator<>());
+                auto file = node.second.get_optional<std::string>("<xmlattr>.file");
+
+                // Relative to the scene file.
+                if (file) {
+                    auto mesh = load_mesh_file(
+                        (std::filesystem::path(m_filename).parent_path() / *file).string(), m_pool);
+                    vertices = std::move(mesh.vertices);
+                    faces = std::move(mesh.faces);
+                }
+
+                std::map<std::string, const std::function<void(const pt::ptree::value_type &)>> node_handlers {
+                    {"vert", [&vertices](const pt::ptree::value_type &node){
+                        vertices->push_back(node.second.get_value(Vec3{0, 0, 0}, Vec3Translator<>()));
+                    }},
+                    {"face", [&faces](const pt::ptree::value_type &node){
+                        // Parsed in double, floats are not exact past 2^24.
+                        auto face = node.second.get_value(std::array{0.0, 0.0, 0.0}, Vec3Translator<double>());
+                        faces.push_back({
+                            static_cast<uint32_t>(face[0]),
+                            static_cast<uint32_t>(face[1]),
+                            static_cast<uint32_t>(face[2])
+                        });
+                    }},
+                    {"color", [&color](const pt::ptree::value_type &node){
+                        color = node.second.get_value(Vec3{0, 0, 0}, Vec3Translator<>());
+                    }},
+                };
+
+                for (const auto &node: node.second) {
+                    auto handler = node_handlers.find(node.first);
+                    if (handler != node_handlers.end()) handler->second(node);
+                }
+
+                // An empty mesh has no bounds to put in the scene's BVH.
+                if (faces.empty()) {
+                    throw std::runtime_error(
+                        std::string("Mesh ") + (file ? *file + " " : "") + "in " + m_filename + " has no faces");
+                }
+
+                surfaces.push_back(TriangleMesh(std::move(vertices), std::move(faces), Color::from_rgb(color)));
+            }},
+            {"prototype", [this](const pt::ptree::value_type &node){
+                auto name = node.second.get<std::string>("<xmlattr>.name");
+                // Its surfaces are parsed like the scene's, into a list of
+                // their own.
+                std::vector<Surface> scene_surfaces;
+                std::swap(surfaces, scene_surfaces);
+
+                for (const auto &node: node.second) {
+                    if (handles(node.first)) parse(node);
+                }
+
+                std::swap(surfaces, scene_surfaces);
+
+                if (scene_surfaces.empty()) {
+                    throw std::runtime_error("Prototype " + name + " in " + m_filename + " is empty");
+                }
+
+                prototypes[name] = std::make_shared<const Prototype>(std::move(scene_surfaces));
+            }},
+            {"instance", [this](const pt::ptree::value_type &node){
+                auto name = node.second.get<std::string>("<xmlattr>.prototype");
+                auto prototype = prototypes.find(name);
+
+                if (prototype == prototypes.end()) {
+                    throw std::runtime_error("Instance of undefined prototype " + name);
+                }
+
+                Mat3x3 linear{Vec3{1, 0, 0}, Vec3{0, 1, 0}, Vec3{0, 0, 1}};
+                Vec3 translation{0, 0, 0};
+                // Applies a linear transform after the previous ones.
+                auto transform = [&](const Mat3x3 &step) {
+                    linear = dot(linear, step);
+                    translation = dot(translation, step);
+                };
+
+                // Transforms apply in document order.
+                for (const auto &node: node.second) {
+                    if (node.first == "translate") {
+                        translation = translation + node.second.get_value(Vec3{0, 0, 0}, Vec3Translator<>());
+                    } else if (node.first == "scale") {
+                        // One factor, or one per axis.
+                        auto factor = node.second.get_value<real>(real(1));
+                        auto scale = node.second.get_value(Vec3{factor, factor, factor}, Vec3Translator<>());
+                        transform({Vec3{scale[0], 0, 0}, Vec3{0, scale[1], 0}, Vec3{0, 0, scale[2]}});
+                    } else if (node.first == "rotate") {
+                        // Degrees around the x, y and z axes, in that order,
+                        // counterclockwise looking down the axis.
+                        auto degrees = node.second.get_value(Vec3{0, 0, 0}, Vec3Translator<>());
+                        auto radians = degrees * static_cast<real>(std::acos(-1.0) / 180);
+                        auto c = Vec3{std::cos(radians[0]), std::cos(radians[1]), std::cos(radians[2])};
+                        auto s = Vec3{std::sin(radians[0]), std::sin(radians[1]), std::sin(radians[2])};
+                        transform({Vec3{1, 0, 0}, Vec3{0, c[0], s[0]}, Vec3{0, -s[0], c[0]}});
+                        transform({Vec3{c[1], 0, -s[1]}, Vec3{0, 1, 0}, Vec3{s[1], 0, c[1]}});
+                        transform({Vec3{c[2], s[2], 0}, Vec3{-s[2], c[2], 0}, Vec3{0, 0, 1}});
+                    }
+                }
+
+                surfaces.push_back(Instance(prototype->second, linear, translation));
+            }},
+        } {}
+
+    SceneReloader::SceneReloader(std::string filename, ThreadPool *pool) :
+        m_filename(std::move(filename)), m_pool(pool) {}
+
+    SceneReloader::~SceneReloader() = default;
+
+    Scene SceneReloader::load() {
+        auto document = std::make_unique<pt::ptree>();
+        auto parser = std::make_unique<Parser>(m_filename, m_pool);
+        std::vector<Element> elements;
+
+        read_xml(m_filename, *document);
+
+        for (const auto &node: document->get_child("scene")) {
+            if (parser->handles(node.first)) {
+                auto first_surface = parser->surfaces.size();
+                parser->parse(node);
+                elements.push_back({&node, first_surface, parser->surfaces.size() - first_surface});
+            }
+        }
+
+        Scene scene(std::move(parser->surfaces), Color::from_rgb(parser->sky_color), Normal3(parser->sunlight_normal));
+        scene.set_sampler(parser->sampler);
+        parser->surfaces.clear();
+        m_parser = std::move(parser);
+        m_document = std::move(document);
+        m_elements = std::move(elements);
+        return scene;
+    }
+
+    std::optional<SceneUpdate> SceneReloader::reload() {
+        auto load_all = [this]() {
+            SceneUpdate update;
+            update.scene = load();
+            return update;
         };
 
-        for (const auto &node: pt.get_child("scene")) {
-            auto handler = node_handlers.find(node.first);
-            if (handler != node_handlers.end()) handler->second(node);
+        if (!m_parser) {
+            return load_all();
+        }
+
+        auto document = std::make_unique<pt::ptree>();
+        read_xml(m_filename, *document);
+
+        std::vector<const pt::ptree::value_type *> nodes;
+
+        for (const auto &node: document->get_child("scene")) {
+            if (m_parser->handles(node.first)) {
+                nodes.push_back(&node);
+            }
+        }
+
+        // Only the same elements in the same order can be updated in
+        // place. Instances hold on to their prototypes, so a changed
+        // prototype reloads them all.
+        bool in_place = nodes.size() == m_elements.size();
+        std::vector<std::size_t> changed;
+
+        for (std::size_t i = 0; in_place && i < nodes.size(); ++i) {
+            const auto &element = *m_elements[i].node;
+
+            if (nodes[i]->first != element.first) {
+                in_place = false;
+            } else if (nodes[i]->second != element.second) {
+                in_place = nodes[i]->first != "prototype";
+                changed.push_back(i);
+            }
+        }
+
+        if (!in_place) {
+            return load_all();
+        }
+
+        if (changed.empty()) {
+            return std::nullopt;
+        }
+
+        SceneUpdate update;
+
+        for (auto i: changed) {
+            const auto &element = m_elements[i];
+            m_parser->surfaces.clear();
+            m_parser->parse(*nodes[i]);
+
+            if (m_parser->surfaces.size() != element.surface_count) {
+                m_parser->surfaces.clear();
+                return load_all();
+            }
+
+            for (std::size_t j = 0; j < element.surface_count; ++j) {
+                update.surfaces.emplace_back(element.first_surface + j, std::move(m_parser->surfaces[j]));
+            }
+        }
+
+        m_parser->surfaces.clear();
+        update.sky_color = Color::from_rgb(m_parser->sky_color);
+        update.sunlight_normal = m_parser->sunlight_normal;
+        update.sampler = m_parser->sampler;
+
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            m_elements[i].node = nodes[i];
+        }
+
+        m_document = std::move(document);
+        return update;
+    }
+
+    void SceneUpdate::apply(Scene &target) {
+        if (scene) {
+            auto irradiance_cache = target.irradiance_cache();
+            auto render_stats = target.render_stats();
+            target = std::move(*scene);
+            target.set_irradiance_cache(std::move(irradiance_cache));
+            target.set_render_stats(std::move(render_stats));
+        } else {
+            target.replace_surfaces(std::move(surfaces));
+            target.set_sky_color(sky_color);
+            target.set_sunlight_normal(Normal3(sunlight_normal));
+            target.set_sampler(sampler);
+        }
+
+        if (target.irradiance_cache()) {
+            target.irradiance_cache()->clear();
+        }
+    }
+
+    Scene load_scene(const std::string &filename, ThreadPool *pool) {
+        if (is_binary_scene(filename)) {
+            return load_binary_scene(filename);
+        }
+
+        return SceneReloader(filename, pool).load();
+    }
+
+    std::vector<RenderJob> load_jobs(const std::string &filename) {
+        using namespace std::string_literals;
+
+        pt::ptree pt;
+        std::vector<RenderJob> jobs;
+
+        read_xml(filename, pt);
+
+        for (const auto &node: pt.get_child("jobs")) {
+            if (node.first != "job") {
+                continue;
+            }
+
+            RenderJob job;
+            const auto &attributes = node.second;
+            job.width = attributes.get("<xmlattr>.width", job.width);
+            job.height = attributes.get("<xmlattr>.height", job.height);
+            job.samples = attributes.get("<xmlattr>.samples", job.samples);
+            job.wavefront = attributes.get("<xmlattr>.wavefront", job.wavefront);
+            job.position = node.second.get("position", job.position, Vec3Translator<>());
+            job.orientation = node.second.get("orientation", job.orientation, Vec3Translator<double>());
+            job.focal_distance = node.second.get("focal-distance", job.focal_distance);
+            job.plane_size = node.second.get("plane-size", job.plane_size, Vec3Translator<real, 2>());
+
+            auto output = attributes.get("<xmlattr>.output", ""s);
+
+            if (output.empty()) {
+                throw std::runtime_error("Job "s + std::to_string(jobs.size() + 1) + " in " + filename + " has no output");
+            }
+
+            if (job.width <= 0 || job.height <= 0 || job.samples <= 0) {
+                throw std::runtime_error(output + " needs a positive size and sample count");
+            }
+
+            // Relative to the job file.
+            job.output = (std::filesystem::path(filename).parent_path() / output).string();
+            jobs.push_back(std::move(job));
         }
 
-        return Scene(std::move(surfaces), Color::from_rgb(sky_color), Normal3(sunlight_normal));
+        return jobs;
     }
 } // namespace joytracer
@@ -1,10 +1,83 @@
 #pragma once
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <boost/archive/tmpdir.hpp>
 #include <boost/archive/xml_iarchive.hpp>
+#include <boost/property_tree/ptree.hpp>
 
+#include "batch.h"
 #include "joytracer.h"
 
 namespace joytracer
 {
-    Scene load_scene(const std::string &filename);
+    // Loads an XML or binary scene. Mesh files referenced by the scene are
+    // parsed on `pool`, if given.
+    Scene load_scene(const std::string &filename, ThreadPool *pool = nullptr);
+
+    /*
+    * What `SceneReloader` found changed in a scene file: surfaces to
+    * replace in the scene loaded before, or a whole new scene.
+    */
+    struct SceneUpdate {
+        // By their index in the list the scene was built from.
+        std::vector<std::pair<std::size_t, Surface>> surfaces;
+        Color sky_color;
+        Vec3 sunlight_normal;
+        HemisphereSampler sampler;
+        std::optional<Scene> scene;
+
+        // Updates `target` and clears its irradiance cache. A new scene
+        // takes over the cache and statistics of `target`.
+        void apply(Scene &target);
+    };
+
+    /*
+    * Loads an XML scene, and reloads it after edits by parsing it again
+    * and comparing its top level elements with the last version. While
+    * the same elements stay in the same order, only the changed ones are
+    * turned into surfaces, which replace the old ones in the scene's BVH
+    * without a rebuild. Adding, removing or moving elements, or editing a
+    * prototype, loads the whole scene again. Mesh files are only read
+    * again when their element changes.
+    */
+    class SceneReloader {
+    public:
+        SceneReloader(std::string filename, ThreadPool *pool = nullptr);
+        ~SceneReloader();
+
+        SceneReloader(const SceneReloader&) = delete;
+        SceneReloader& operator=(const SceneReloader&) = delete;
+
+        // Parses the whole file, like `load_scene`.
+        Scene load();
+
+        // Parses the file again and returns what changed since the last
+        // call or `load()`, nothing if nothing did. A broken file throws
+        // like `load_scene`, and the next call compares with the last
+        // good version again.
+        std::optional<SceneUpdate> reload();
+    private:
+        class Parser;
+
+        // A top level element of the last version, and the surfaces it made.
+        struct Element {
+            const boost::property_tree::ptree::value_type *node;
+            std::size_t first_surface;
+            std::size_t surface_count;
+        };
+
+        std::string m_filename;
+        ThreadPool *m_pool;
+        std::unique_ptr<Parser> m_parser;
+        std::unique_ptr<boost::property_tree::ptree> m_document;
+        std::vector<Element> m_elements;
+    };
+
+    // Loads the render jobs of an XML job file. Relative output paths are
+    // relative to the job file.
+    std::vector<RenderJob> load_jobs(const std::string &filename);
 } // namespace joytracer
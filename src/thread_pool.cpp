@@ -0,0 +1,148 @@
+#include <exception>
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+namespace joytracer {
+    namespace {
+        // Completion state shared by the tasks of a single `run` call.
+        struct Batch {
+            std::atomic<std::size_t> remaining;
+            std::mutex mutex;
+            std::condition_variable done;
+            std::exception_ptr error;
+        };
+    }
+
+    ThreadPool::ThreadPool(std::size_t thread_count) :
+        m_queued(0), m_next_queue(0), m_stopping(false) {
+        if (thread_count == 0) {
+            throw std::invalid_argument("A ThreadPool needs at least one thread");
+        }
+
+        for (std::size_t i = 0; i < thread_count; ++i) {
+            m_queues.push_back(std::make_unique<Queue>());
+        }
+
+        for (std::size_t i = 0; i < thread_count; ++i) {
+            m_threads.emplace_back([this, i]() { worker_loop(i); });
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_stopping = true;
+        }
+
+        m_wake.notify_all();
+
+        for (auto &t: m_threads) {
+            t.join();
+        }
+    }
+
+    void ThreadPool::run(std::vector<Task> tasks) {
+        if (tasks.empty()) {
+            return;
+        }
+
+        auto batch = std::make_shared<Batch>();
+        batch->remaining = tasks.size();
+        std::size_t queue = m_next_queue.fetch_add(1) % m_queues.size();
+
+        // Deal the tasks round robin, so every worker starts with a share.
+        for (auto &task: tasks) {
+            auto &q = *m_queues[queue];
+            queue = (queue + 1) % m_queues.size();
+            std::scoped_lock lock(q.mutex);
+            q.tasks.push_back([batch, task = std::move(task)]() {
+                try {
+                    task();
+                } catch (...) {
+                    std::scoped_lock lock(batch->mutex);
+
+                    if (!batch->error) {
+                        batch->error = std::current_exception();
+                    }
+                }
+
+                if (batch->remaining.fetch_sub(1) == 1) {
+                    std::scoped_lock lock(batch->mutex);
+                    batch->done.notify_all();
+                }
+            });
+        }
+
+        {
+            std::scoped_lock lock(m_mutex);
+            m_queued += static_cast<long>(tasks.size());
+        }
+
+        m_wake.notify_all();
+
+        // Help out instead of just sleeping.
+        while (batch->remaining > 0) {
+            auto task = pop(queue);
+
+            if (!task) {
+                break;
+            }
+
+            (*task)();
+        }
+
+        std::unique_lock lock(batch->mutex);
+        batch->done.wait(lock, [&]() { return batch->remaining == 0; });
+
+        if (batch->error) {
+            std::rethrow_exception(batch->error);
+        }
+    }
+
+    std::optional<ThreadPool::Task> ThreadPool::pop(std::size_t queue) {
+        {
+            auto &own = *m_queues[queue];
+            std::scoped_lock lock(own.mutex);
+
+            if (!own.tasks.empty()) {
+                auto task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                --m_queued;
+                return task;
+            }
+        }
+
+        for (std::size_t i = 1; i < m_queues.size(); ++i) {
+            auto &victim = *m_queues[(queue + i) % m_queues.size()];
+            std::scoped_lock lock(victim.mutex);
+
+            if (!victim.tasks.empty()) {
+                auto task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                --m_queued;
+                return task;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    void ThreadPool::worker_loop(std::size_t index) {
+        while (true) {
+            auto task = pop(index);
+
+            if (task) {
+                (*task)();
+                continue;
+            }
+
+            std::unique_lock lock(m_mutex);
+            m_wake.wait(lock, [&]() { return m_stopping || m_queued > 0; });
+
+            if (m_stopping && m_queued <= 0) {
+                return;
+            }
+        }
+    }
+}
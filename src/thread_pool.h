@@ -0,0 +1,61 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace joytracer {
+    /*
+    * A persistent pool of worker threads with one task deque each.
+    *
+    * Workers pop tasks from the back of their own deque and, once it is
+    * empty, steal from the front of the others, so uneven tasks balance
+    * themselves out.
+    */
+    class ThreadPool {
+    public:
+        using Task = std::function<void()>;
+
+        explicit ThreadPool(std::size_t thread_count = default_thread_count());
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        std::size_t size() const {
+            return m_threads.size();
+        }
+
+        // Runs all tasks and blocks until they are done. The calling thread
+        // steals work while it waits. The first exception thrown by a task
+        // is rethrown here.
+        void run(std::vector<Task> tasks);
+
+        static std::size_t default_thread_count() {
+            return std::max(1u, std::thread::hardware_concurrency());
+        }
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> m_queues;
+        std::vector<std::thread> m_threads;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        // Signed, since a worker may pop a task before `run` counts it.
+        std::atomic<long> m_queued;
+        std::atomic<std::size_t> m_next_queue;
+        bool m_stopping;
+
+        std::optional<Task> pop(std::size_t queue);
+        void worker_loop(std::size_t index);
+    };
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace joytracer {
+    /*
+    * Hands frames from one writer thread to one reader thread without
+    * locks or waiting.
+    *
+    * Of three buffers, the writer fills the back one and the reader shows
+    * the front one; the third holds the latest frame published. Publishing
+    * swaps the back buffer with that one, acquiring swaps the front buffer
+    * with it if it is new. Neither side ever touches the other's buffer,
+    * and the reader skips frames it was too slow for. This class only
+    * tracks the indices, the buffers belong to the caller.
+    */
+    class TripleBuffer {
+    public:
+        // Index of the buffer the writer fills.
+        int back() const {
+            return m_back;
+        }
+
+        // Index of the buffer the reader shows.
+        int front() const {
+            return m_front;
+        }
+
+        // Called by the writer once the back buffer is complete. It gets
+        // another buffer to fill next.
+        void publish() {
+            m_back = m_latest.exchange(static_cast<uint8_t>(m_back | fresh), std::memory_order_acq_rel) & index_mask;
+        }
+
+        // Called by the reader. Makes the latest frame the front buffer
+        // and returns true, or returns false if none was published since
+        // the last call.
+        bool acquire() {
+            if (!(m_latest.load(std::memory_order_relaxed) & fresh)) {
+                return false;
+            }
+
+            m_front = m_latest.exchange(static_cast<uint8_t>(m_front), std::memory_order_acq_rel) & index_mask;
+            return true;
+        }
+    private:
+        static constexpr uint8_t index_mask = 3;
+        // Set on the latest buffer from publishing until acquiring.
+        static constexpr uint8_t fresh = 4;
+
+        int m_back = 0;
+        int m_front = 1;
+        std::atomic<uint8_t> m_latest{2};
+    };
+}
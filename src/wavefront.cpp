@@ -0,0 +1,159 @@
+#include <algorithm>
+
+#include "wavefront.h"
+
+namespace joytracer {
+    void Wavefront::trace(const Scene &scene, const std::vector<Ray> &rays, int depth,
+        std::vector<Color> &colors) {
+        m_queues.resize(std::max(depth, 0));
+        m_radiance.assign(rays.size(), Vec3{0, 0, 0});
+
+        for (auto &queue: m_queues) {
+            queue.clear();
+        }
+
+        if (!m_queues.empty()) {
+            for (std::size_t i = 0; i < rays.size(); ++i) {
+                m_queues.front().push_back({rays[i], Vec3{1, 1, 1}, static_cast<uint32_t>(i)});
+            }
+        }
+
+        auto *counters = scene.counters();
+
+        for (;;) {
+            auto level = std::find_if(m_queues.rbegin(), m_queues.rend(),
+                [](const auto &queue) { return !queue.empty(); });
+
+            if (level == m_queues.rend()) {
+                break;
+            }
+
+            auto &queue = *level;
+            auto count = std::min(m_batch_size, queue.size());
+            m_batch.assign(queue.end() - count, queue.end());
+            queue.erase(queue.end() - count, queue.end());
+
+            // Rays of this batch are as deep as their queue, and rays
+            // traced while shading them one deeper.
+            if (counters) {
+                counters->depth = static_cast<std::size_t>(m_queues.rend() - level) - 1;
+            }
+
+            RayDepthScope depth(counters, count);
+            intersect(scene);
+            trace_shadows(scene);
+            // The deepest queue's rays are traced with `reflect == 1`, so
+            // their secondary rays would all come back black.
+            shade(scene, static_cast<int>(level - m_queues.rbegin()) + 1,
+                level == m_queues.rbegin() ? nullptr : &*(level - 1));
+        }
+
+        if (counters) {
+            counters->depth = 0;
+        }
+
+        colors.resize(rays.size());
+        std::transform(m_radiance.begin(), m_radiance.end(), colors.begin(), Color::from_rgb);
+    }
+
+    void Wavefront::intersect(const Scene &scene) {
+        m_hits.clear();
+
+        for (std::size_t first = 0; first < m_batch.size(); first += packet_width) {
+            auto lanes = std::min(packet_width, m_batch.size() - first);
+            Lanes<Vec3> origins;
+            Lanes<Vec3> directions;
+            Lanes<bool> active{};
+
+            for (std::size_t i = 0; i < lanes; ++i) {
+                origins[i] = m_batch[first + i].ray.get_origin();
+                directions[i] = m_batch[first + i].ray.get_normal();
+                active[i] = true;
+            }
+
+            PacketHits hits;
+            scene.trace_packet_hits(RayPacket::from_rays(origins, directions, active), hits);
+
+            // Compact the rays that hit, misses only pick up the sky.
+            for (std::size_t i = 0; i < lanes; ++i) {
+                const auto &path = m_batch[first + i];
+                std::optional<HitResult> hit;
+
+                if (hits.primitive[i] != PacketHits::no_hit) {
+                    hit = std::visit(HitTestVisitor(path.ray), scene.hit_surface(hits.primitive[i]));
+
+                    // The kernels round differently, so on an edge the
+                    // winner may miss here. Let the scalar search decide.
+                    if (!hit) {
+                        hit = scene.trace_single_ray(path.ray);
+                    }
+                }
+
+                if (hit) {
+                    m_hits.push_back({*hit, static_cast<uint32_t>(first + i)});
+                } else {
+                    auto &radiance = m_radiance[path.pixel];
+                    radiance = radiance + path.weight * scene.sky_color(path.ray).to_rgb();
+                }
+            }
+        }
+    }
+
+    void Wavefront::trace_shadows(const Scene &scene) {
+        m_in_shadow.resize(m_hits.size());
+        Lanes<Vec3> directions;
+        directions.fill(scene.m_sunlight_normal * real(-1));
+
+        for (std::size_t first = 0; first < m_hits.size(); first += packet_width) {
+            auto lanes = std::min(packet_width, m_hits.size() - first);
+            Lanes<Vec3> origins;
+            Lanes<bool> active{};
+
+            for (std::size_t i = 0; i < lanes; ++i) {
+                origins[i] = m_hits[first + i].hit.point();
+                active[i] = true;
+            }
+
+            auto blocked = scene.occluded(RayPacket::from_rays(origins, directions, active));
+            std::copy(blocked.begin(), blocked.begin() + lanes, m_in_shadow.begin() + first);
+        }
+    }
+
+    void Wavefront::shade(const Scene &scene, int reflect, std::vector<PathRay> *next_queue) {
+        // Same mix as `Scene::shade`: half the base color times the direct
+        // light, or times the average of the diffuse rays in shadow, plus
+        // half the base color times the reflection.
+        for (std::size_t i = 0; i < m_hits.size(); ++i) {
+            const auto &hit = m_hits[i].hit;
+            const auto &path = m_batch[m_hits[i].ray];
+            auto weight = path.weight * hit.color().to_rgb() * real(0.5);
+
+            if (!m_in_shadow[i]) {
+                auto &radiance = m_radiance[path.pixel];
+                radiance = radiance + weight;
+            }
+
+            if (!next_queue) {
+                continue;
+            }
+
+            next_queue->push_back({Scene::reflection_ray(path.ray, hit), weight, path.pixel});
+
+            if (m_in_shadow[i] && scene.m_irradiance_cache) {
+                // A cache miss gathers the hemisphere depth first, so the
+                // record is there for the next hits.
+                auto &radiance = m_radiance[path.pixel];
+                radiance = radiance + weight * scene.diffuse_light(hit, reflect).to_rgb();
+            } else if (m_in_shadow[i]) {
+                auto basis = Scene::diffuse_basis(hit);
+                auto rotation = scene.m_sampler.rotation(hit.point(), reflect);
+                auto count = scene.diffuse_ray_count();
+                auto diffuse_weight = weight / static_cast<real>(count);
+
+                for (std::size_t j = 0; j < count; ++j) {
+                    next_queue->push_back({scene.diffuse_ray(hit, basis, rotation, j), diffuse_weight, path.pixel});
+                }
+            }
+        }
+    }
+} // namespace joytracer
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "joymath.h"
+#include "joytracer.h"
+
+namespace joytracer {
+    /*
+    * A breadth-first alternative to `Scene::trace_ray`.
+    *
+    * Rather than following every path down to its last bounce before
+    * starting the next one, rays wait in one queue per bounce depth. A
+    * batch taken from a queue goes through each stage together: nearest
+    * hits as packets, compaction of the rays that hit something, shadow
+    * rays toward the sun as packets, then shading, which adds light to the
+    * pixel of each ray and queues its secondary rays one level deeper.
+    *
+    * Shading is linear in the light that comes back, so every ray carries
+    * the weight its light has in its pixel instead of returning a color.
+    * The deepest non-empty queue is always drained first, which keeps the
+    * queues to a few batches no matter how many rays a path spawns.
+    *
+    * Buffers are kept from one call to the next, so use one instance per
+    * thread.
+    *
+    * With an irradiance cache, the diffuse light of a shadowed hit comes
+    * from `Scene::diffuse_light` rather than from queued diffuse rays.
+    */
+    class Wavefront {
+    public:
+        explicit Wavefront(std::size_t batch_size = 1024) :
+            m_batch_size(batch_size) {}
+
+        // Traces each of `rays` like `Scene::trace_ray(ray, depth)` does,
+        // and stores their colors in `colors`.
+        void trace(const Scene &scene, const std::vector<Ray> &rays, int depth,
+            std::vector<Color> &colors);
+    private:
+        struct PathRay {
+            Ray ray;
+            Vec3 weight;
+            uint32_t pixel;
+        };
+
+        struct PathHit {
+            HitResult hit;
+            uint32_t ray;
+        };
+
+        std::size_t m_batch_size;
+        std::vector<std::vector<PathRay>> m_queues;
+        std::vector<PathRay> m_batch;
+        std::vector<PathHit> m_hits;
+        std::vector<lane_int> m_in_shadow;
+        std::vector<Vec3> m_radiance;
+
+        void intersect(const Scene &scene);
+        void trace_shadows(const Scene &scene);
+        void shade(const Scene &scene, int reflect, std::vector<PathRay> *next_queue);
+    };
+}
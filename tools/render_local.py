@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""Renders a scene in parts on separate local processes, then merges them.
+
+Splits the image into a grid of regions and the samples into ranges, runs
+joytracer_headless once per region and range, and assembles the partial
+images with joytracer_merge. Spreading the parts over machines instead
+only changes how the same commands are started.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+from concurrent.futures import ThreadPoolExecutor
+
+
+def split(size, parts):
+    """Splits 0..size into `parts` nearly equal, non-empty ranges."""
+    parts = max(1, min(parts, size))
+    bounds = [size * i // parts for i in range(parts + 1)]
+    return list(zip(bounds, bounds[1:]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("scene")
+    parser.add_argument("output")
+    parser.add_argument("--width", type=int, default=640)
+    parser.add_argument("--height", type=int, default=480)
+    parser.add_argument("--samples", type=int, default=1)
+    parser.add_argument("--columns", type=int, default=2, help="regions across the image")
+    parser.add_argument("--rows", type=int, default=2, help="regions down the image")
+    parser.add_argument("--sample-ranges", type=int, default=1, help="ranges the samples are split into")
+    parser.add_argument("--processes", type=int, default=os.cpu_count() or 1,
+                        help="parts rendered at once")
+    parser.add_argument("--bin", default="build", help="directory holding the joytracer executables")
+    parser.add_argument("--keep", metavar="DIR", help="write the partial images to DIR and keep them")
+    parser.add_argument("--wavefront", action="store_true")
+    args = parser.parse_args()
+
+    headless = os.path.join(args.bin, "joytracer_headless")
+    merge = os.path.join(args.bin, "joytracer_merge")
+    threads = max(1, (os.cpu_count() or 1) // args.processes)
+
+    with tempfile.TemporaryDirectory() as temporary:
+        directory = args.keep or temporary
+        os.makedirs(directory, exist_ok=True)
+        commands = []
+
+        for y_begin, y_end in split(args.height, args.rows):
+            for x_begin, x_end in split(args.width, args.columns):
+                for first, end in split(args.samples, args.sample_ranges):
+                    part = os.path.join(directory, f"part_{x_begin}_{y_begin}_{first}.jpart")
+                    command = [headless, args.scene, part,
+                               "--width", str(args.width), "--height", str(args.height),
+                               "--threads", str(threads),
+                               "--region", f"{x_begin},{y_begin},{x_end},{y_end}",
+                               "--sample-range", f"{first},{end}"]
+
+                    if args.wavefront:
+                        command.append("--wavefront")
+
+                    commands.append((part, command))
+
+        def run(command):
+            return subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+
+        with ThreadPoolExecutor(args.processes) as executor:
+            results = list(executor.map(run, [command for _, command in commands]))
+
+        failed = [(command, result) for (_, command), result in zip(commands, results) if result.returncode]
+
+        for command, result in failed:
+            print(" ".join(command), "failed:", result.stderr.strip(), file=sys.stderr)
+
+        if failed:
+            return 1
+
+        print(f"Rendered {len(commands)} parts on {args.processes} processes.")
+        return subprocess.run([merge, args.output] + [part for part, _ in commands]).returncode
+
+
+if __name__ == "__main__":
+    sys.exit(main())
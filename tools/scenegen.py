@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+"""Generates XML scenes of random spheres and triangles, for load tests.
+
+The primitives fill a box in front of the default camera of
+joytracer_headless, spread by one of a few distributions. The same
+arguments and seed always give the same scene.
+"""
+
+import argparse
+import math
+import random
+import sys
+
+DISTRIBUTIONS = ("uniform", "clustered", "grid", "corridor")
+
+
+def positions(count, distribution, extent, rng):
+    """Yields `count` points in the box the camera sees, `extent` wide.
+
+    uniform: anywhere in the box.
+    clustered: around a few centers, so density varies a lot.
+    grid: a regular lattice, many primitives share split planes.
+    corridor: a long thin strip along the view axis, deep rather than wide.
+    """
+    width = extent
+    depth = extent
+    height = extent / 4
+    near = 3.0
+
+    if distribution == "uniform":
+        for _ in range(count):
+            yield (rng.uniform(-width / 2, width / 2), near + rng.uniform(0, depth), rng.uniform(0, height))
+    elif distribution == "clustered":
+        centers = [(rng.uniform(-width / 2, width / 2), near + rng.uniform(0, depth), rng.uniform(0, height))
+                   for _ in range(max(1, int(math.sqrt(count) / 4)))]
+        spread = extent / 40
+
+        for _ in range(count):
+            x, y, z = rng.choice(centers)
+            yield (rng.gauss(x, spread), max(near, rng.gauss(y, spread)), max(0.0, rng.gauss(z, spread)))
+    elif distribution == "grid":
+        side = max(1, math.ceil(count ** (1 / 3)))
+
+        for i in range(count):
+            x, y, z = i % side, (i // side) % side, i // (side * side)
+            yield ((x / side - 0.5) * width, near + y / side * depth, z / side * height)
+    elif distribution == "corridor":
+        for _ in range(count):
+            yield (rng.uniform(-2, 2), near + rng.uniform(0, depth * 10), rng.uniform(0, 2))
+    else:
+        raise ValueError(f"unknown distribution {distribution}")
+
+
+def generate(spheres, triangles, distribution="uniform", extent=40.0, size=None, seed=1, mesh=False):
+    """Returns the XML text of a scene.
+
+    `size` is the radius of the spheres and the half size of the triangles,
+    by default small enough that they seldom overlap. With `mesh`, the
+    triangles go into one inline <mesh> instead of separate elements.
+    """
+    rng = random.Random(seed)
+    count = spheres + triangles
+    size = size or extent / max(1.0, count ** (1 / 3)) * 0.3
+    lines = [
+        "<scene>",
+        "    <sky-color>0.0, 0.40, 0.80</sky-color>",
+        "    <sunlight-normal>1.0, 1.0, -1.0</sunlight-normal>",
+        "    <floor />",
+    ]
+    points = positions(count, distribution, extent, rng)
+
+    def color():
+        return f"{rng.uniform(0.1, 1):.3f}, {rng.uniform(0.1, 1):.3f}, {rng.uniform(0.1, 1):.3f}"
+
+    for _ in range(spheres):
+        x, y, z = next(points)
+        lines += [
+            "    <sphere>",
+            f"        <radius>{size:.4f}</radius>",
+            f"        <center>{x:.4f}, {y:.4f}, {z + size:.4f}</center>",
+            f"        <color>{color()}</color>",
+            "    </sphere>",
+        ]
+
+    vertices = []
+
+    for _ in range(triangles):
+        x, y, z = next(points)
+        vertices.append([(x + rng.uniform(-size, size), y + rng.uniform(-size, size), z + rng.uniform(0, 2 * size))
+                         for _ in range(3)])
+
+    if mesh and vertices:
+        lines.append(f'    <mesh color="{color()}">')
+        lines += [f"        <vert>{x:.4f}, {y:.4f}, {z:.4f}</vert>" for triangle in vertices for x, y, z in triangle]
+        lines += [f"        <face>{3 * i}, {3 * i + 1}, {3 * i + 2}</face>" for i in range(len(vertices))]
+        lines.append("    </mesh>")
+    else:
+        for triangle in vertices:
+            lines.append("    <triangle>")
+            lines += [f"        <vert>{x:.4f}, {y:.4f}, {z:.4f}</vert>" for x, y, z in triangle]
+            lines += [f"        <color>{color()}</color>", "    </triangle>"]
+
+    lines.append("</scene>")
+    return "\n".join(lines) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("output", help="scene file to write, - for stdout")
+    parser.add_argument("--spheres", type=int, default=1000)
+    parser.add_argument("--triangles", type=int, default=1000)
+    parser.add_argument("--distribution", choices=DISTRIBUTIONS, default="uniform")
+    parser.add_argument("--extent", type=float, default=40.0, help="width of the filled box, in scene units")
+    parser.add_argument("--size", type=float, help="sphere radius and half triangle size")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--mesh", action="store_true", help="put the triangles in a single mesh")
+    args = parser.parse_args()
+
+    scene = generate(args.spheres, args.triangles, args.distribution, args.extent, args.size, args.seed, args.mesh)
+
+    if args.output == "-":
+        sys.stdout.write(scene)
+    else:
+        with open(args.output, "w") as file:
+            file.write(scene)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""Renders generated scenes at several sizes and thread counts, as CSV.
+
+Every scene from scenegen.py is rendered once per thread count by
+joytracer_headless with --stats. Each row reports the load and render
+times, the rays traced per second of rendering and the peak resident
+memory the renderer reports, which it only does on Linux. Comparing two
+sweeps then shows scaling regressions.
+"""
+
+import argparse
+import csv
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+import scenegen
+
+
+def int_list(text):
+    return [int(value) for value in text.split(",")]
+
+
+def render(command):
+    """Runs `command`, returns its exit code and error output."""
+    process = subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    return process.returncode, process.stderr.decode().strip()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--bin", default="build", help="directory holding joytracer_headless")
+    parser.add_argument("--sizes", type=int_list, default=[1000, 10000, 100000],
+                        help="comma separated primitive counts")
+    parser.add_argument("--threads", type=int_list, default=sorted({1, os.cpu_count() or 1}),
+                        help="comma separated thread counts")
+    parser.add_argument("--distributions", default="uniform",
+                        help="comma separated, from " + ", ".join(scenegen.DISTRIBUTIONS))
+    parser.add_argument("--triangle-share", type=float, default=0.5,
+                        help="fraction of the primitives that are triangles")
+    parser.add_argument("--mesh", action="store_true", help="put the triangles in a single mesh")
+    parser.add_argument("--width", type=int, default=320)
+    parser.add_argument("--height", type=int, default=240)
+    parser.add_argument("--samples", type=int, default=1)
+    parser.add_argument("--diffuse-rays", type=int, default=2,
+                        help="rays per shadowed hit, few to keep dense scenes quick")
+    parser.add_argument("--wavefront", action="store_true")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--output", help="CSV file to write, stdout by default")
+    args = parser.parse_args()
+
+    headless = os.path.join(args.bin, "joytracer_headless")
+    distributions = args.distributions.split(",")
+    columns = ["distribution", "primitives", "spheres", "triangles", "threads", "width", "height",
+               "samples", "diffuse_rays", "load_ms", "render_ms", "rays", "rays_per_second", "peak_rss_mb"]
+    output = open(args.output, "w", newline="") if args.output else sys.stdout
+    writer = csv.DictWriter(output, columns)
+    writer.writeheader()
+
+    with tempfile.TemporaryDirectory() as directory:
+        for distribution in distributions:
+            for size in args.sizes:
+                triangles = round(size * args.triangle_share)
+                spheres = size - triangles
+                scene = os.path.join(directory, f"{distribution}_{size}.xml")
+
+                with open(scene, "w") as file:
+                    file.write(scenegen.generate(spheres, triangles, distribution, seed=args.seed, mesh=args.mesh))
+
+                for threads in args.threads:
+                    stats_file = os.path.join(directory, "stats.json")
+                    command = [headless, scene, os.path.join(directory, "image.pfm"),
+                               "--width", str(args.width), "--height", str(args.height),
+                               "--samples", str(args.samples), "--threads", str(threads),
+                               "--diffuse-rays", str(args.diffuse_rays),
+                               "--stats", stats_file]
+
+                    if args.wavefront:
+                        command.append("--wavefront")
+
+                    returncode, error = render(command)
+
+                    if returncode:
+                        print(" ".join(command), "failed:", error, file=sys.stderr)
+                        return 1
+
+                    with open(stats_file) as file:
+                        stats = json.load(file)
+
+                    phases = {phase["name"]: phase["milliseconds"] for phase in stats["phases"]}
+                    render_ms = sum(milliseconds for name, milliseconds in phases.items()
+                                    if name not in ("load", "write"))
+                    rays = sum(stats["rays"].values())
+                    # The renderer's own high-water mark: the ru_maxrss of a
+                    # child on Linux starts at the size of this script.
+                    peak_rss = stats.get("peak_resident_bytes")
+                    writer.writerow({
+                        "distribution": distribution,
+                        "primitives": size,
+                        "spheres": spheres,
+                        "triangles": triangles,
+                        "threads": threads,
+                        "width": args.width,
+                        "height": args.height,
+                        "samples": args.samples,
+                        "diffuse_rays": args.diffuse_rays,
+                        "load_ms": f"{phases.get('load', 0):.1f}",
+                        "render_ms": f"{render_ms:.1f}",
+                        "rays": rays,
+                        "rays_per_second": f"{rays / (render_ms / 1000):.0f}" if render_ms > 0 else "",
+                        "peak_rss_mb": f"{peak_rss / (1024 * 1024):.1f}" if peak_rss else "",
+                    })
+                    output.flush()
+
+    if output is not sys.stdout:
+        output.close()
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())